@@ -0,0 +1,362 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "finwo/endian.h"
+
+#include "palloc.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+// Needs to be AFTER winsock2 which is used for endian.h
+#include <windows.h>
+#include <io.h>
+#include <BaseTsd.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "finwo/io.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#define OPENMODE  (_S_IREAD | _S_IWRITE)
+#elif defined(__APPLE__)
+#define OPENMODE  (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+#else
+#define OPENMODE  (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+#endif
+
+// Replays a trace written by palloc_record against a fresh medium
+//
+// Usage: palloc-replay <trace> [medium]
+
+#define REPLAY_ALLOC 'a'
+#define REPLAY_FREE  'f'
+
+#define REPLAY_SEEK     0
+#define REPLAY_READ     1
+#define REPLAY_WRITE    2
+#define REPLAY_TRUNCATE 3
+#define REPLAY_LOCK     4
+#define REPLAY_PUNCH    5
+#define REPLAY_CALLS    6
+
+const char *replay_call_names[REPLAY_CALLS] = { "seek", "read", "write", "truncate", "lock", "punch" };
+
+// Backend: counting {{{
+
+// Wraps the os backend, counting the calls going through it
+
+uint64_t replay_calls[REPLAY_CALLS];
+
+int64_t replay_seek(void *udata, int64_t offset, int whence) {
+  replay_calls[REPLAY_SEEK]++;
+  return palloc_backend_os.seek(udata, offset, whence);
+}
+
+int64_t replay_read(void *udata, void *buf, PALLOC_SIZE count) {
+  replay_calls[REPLAY_READ]++;
+  return palloc_backend_os.read(udata, buf, count);
+}
+
+int64_t replay_write(void *udata, const void *buf, PALLOC_SIZE count) {
+  replay_calls[REPLAY_WRITE]++;
+  return palloc_backend_os.write(udata, buf, count);
+}
+
+int replay_truncate(void *udata, PALLOC_OFFSET length) {
+  replay_calls[REPLAY_TRUNCATE]++;
+  return palloc_backend_os.truncate(udata, length);
+}
+
+int replay_close(void *udata) {
+  return palloc_backend_os.close(udata);
+}
+
+int replay_lock(void *udata, PALLOC_OFFSET offset, PALLOC_SIZE length, int type) {
+  replay_calls[REPLAY_LOCK]++;
+  return palloc_backend_os.lock ? palloc_backend_os.lock(udata, offset, length, type) : 0;
+}
+
+int replay_punch(void *udata, PALLOC_OFFSET offset, PALLOC_SIZE length) {
+  replay_calls[REPLAY_PUNCH]++;
+  return palloc_backend_os.punch ? palloc_backend_os.punch(udata, offset, length) : -1;
+}
+
+const struct palloc_backend replay_backend = {
+  .seek     = replay_seek,
+  .read     = replay_read,
+  .write    = replay_write,
+  .truncate = replay_truncate,
+  .close    = replay_close,
+  .lock     = replay_lock,
+  .punch    = replay_punch,
+};
+
+// }}}
+
+// Offset map {{{
+
+// Open-addressing map from recorded to replayed pointers
+
+struct replay_map {
+  PALLOC_OFFSET *keys;
+  PALLOC_OFFSET *values;
+  PALLOC_SIZE   length;
+  PALLOC_SIZE   capacity;
+};
+
+PALLOC_SIZE replay_map_slot(struct replay_map *map, PALLOC_OFFSET key) {
+  PALLOC_SIZE slot = (key * 0x9E3779B97F4A7C15ULL) & (map->capacity - 1);
+  while(map->keys[slot] && (map->keys[slot] != key)) slot = (slot + 1) & (map->capacity - 1);
+  return slot;
+}
+
+int replay_map_resize(struct replay_map *map, PALLOC_SIZE capacity) {
+  struct replay_map grown = { calloc(capacity, sizeof(PALLOC_OFFSET)), calloc(capacity, sizeof(PALLOC_OFFSET)), 0, capacity };
+  PALLOC_SIZE i, slot;
+  if (!grown.keys || !grown.values) {
+    free(grown.keys);
+    free(grown.values);
+    return -1;
+  }
+  for(i = 0; i < map->capacity; i++) {
+    if (!map->values[i]) continue;
+    slot = replay_map_slot(&grown, map->keys[i]);
+    grown.keys[slot]   = map->keys[i];
+    grown.values[slot] = map->values[i];
+    grown.length++;
+  }
+  free(map->keys);
+  free(map->values);
+  *map = grown;
+  return 0;
+}
+
+// Removed entries keep their key as a tombstone, with a value of 0
+int replay_map_set(struct replay_map *map, PALLOC_OFFSET key, PALLOC_OFFSET value) {
+  PALLOC_SIZE slot;
+  if (((map->length + 1) * 2) > map->capacity) {
+    if (replay_map_resize(map, map->capacity ? (map->capacity * 2) : 1024)) return -1;
+  }
+  slot = replay_map_slot(map, key);
+  if (!map->keys[slot]) map->length++;
+  map->keys[slot]   = key;
+  map->values[slot] = value;
+  return 0;
+}
+
+PALLOC_OFFSET replay_map_get(struct replay_map *map, PALLOC_OFFSET key) {
+  if (!map->capacity) return 0;
+  return map->values[replay_map_slot(map, key)];
+}
+
+// }}}
+
+// Latencies {{{
+
+struct replay_latency {
+  uint64_t    *samples;
+  PALLOC_SIZE length;
+  PALLOC_SIZE capacity;
+  uint64_t    total;
+};
+
+uint64_t replay_clock() {
+#if defined(_WIN32) || defined(_WIN64)
+  LARGE_INTEGER now, frequency;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&frequency);
+  return ((uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000000) + (((uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000000) / frequency.QuadPart);
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+#endif
+}
+
+int replay_latency_add(struct replay_latency *latency, uint64_t sample) {
+  uint64_t *grown;
+  if (latency->length == latency->capacity) {
+    latency->capacity = latency->capacity ? (latency->capacity * 2) : 1024;
+    grown = realloc(latency->samples, latency->capacity * sizeof(uint64_t));
+    if (!grown) return -1;
+    latency->samples = grown;
+  }
+  latency->samples[latency->length++] = sample;
+  latency->total += sample;
+  return 0;
+}
+
+int replay_latency_cmp(const void *a, const void *b) {
+  uint64_t left  = *((const uint64_t *)a);
+  uint64_t right = *((const uint64_t *)b);
+  return (left > right) - (left < right);
+}
+
+void replay_latency_report(const char *name, struct replay_latency *latency) {
+  if (!latency->length) {
+    printf("%-8s      0 ops\n", name);
+    return;
+  }
+  qsort(latency->samples, latency->length, sizeof(uint64_t), replay_latency_cmp);
+  printf("%-8s %6llu ops, ns avg %llu p50 %llu p99 %llu max %llu\n", name,
+    (unsigned long long)latency->length,
+    (unsigned long long)(latency->total / latency->length),
+    (unsigned long long)latency->samples[latency->length / 2],
+    (unsigned long long)latency->samples[(latency->length * 99) / 100],
+    (unsigned long long)latency->samples[latency->length - 1]
+  );
+}
+
+// }}}
+
+int replay_varint(FILE *trace, uint64_t *value) {
+  int shift = 0, byte;
+  *value = 0;
+  do {
+    byte = fgetc(trace);
+    if ((byte == EOF) || (shift > 63)) return -1;
+    *value |= ((uint64_t)(byte & 0x7F)) << shift;
+    shift  += 7;
+  } while(byte & 0x80);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char            *medium = (argc > 2) ? argv[2] : "palloc-replay.db";
+  struct replay_map     map     = { NULL, NULL, 0, 0 };
+  struct replay_latency allocs  = { NULL, 0, 0, 0 };
+  struct replay_latency frees   = { NULL, 0, 0, 0 };
+  struct palloc_stats   stats;
+  char                  header[16];
+  uint32_t              flags;
+  uint64_t              size, delta, requested, ptr, recorded = 0, start, elapsed;
+  PALLOC_OFFSET         result;
+  PALLOC_SIZE           failed = 0, unknown = 0, i;
+  int                   op, descriptor, err = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <trace> [medium]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *trace = fopen(argv[1], "rb");
+  if (!trace) {
+    perror("fopen");
+    return 1;
+  }
+  if ((fread(header, 1, sizeof(header), trace) != sizeof(header)) || memcmp(header, "PBR\0", 4)) {
+    fprintf(stderr, "%s: not a palloc trace\n", argv[1]);
+    fclose(trace);
+    return 1;
+  }
+  memcpy(&flags, header + 4, sizeof(flags));
+  memcpy(&size, header + 8, sizeof(size));
+  flags = be32toh(flags);
+  size  = be64toh(size);
+
+  // Fresh medium of the recorded flavour, sized like the original if fixed
+  if (unlink_os(medium) && (errno != ENOENT)) perror("unlink");
+  descriptor = open_os(medium, O_RDWR | O_CREAT, OPENMODE);
+  if (descriptor < 0) {
+    perror("open");
+    fclose(trace);
+    return 1;
+  }
+  if (!(flags & PALLOC_DYNAMIC) && truncate_os(descriptor, size)) {
+    perror("truncate");
+  }
+  PALLOC_FD fd = palloc_open_backend(&replay_backend, (void*)(intptr_t)descriptor);
+  if (palloc_init(fd, flags) != PALLOC_OK) {
+    fprintf(stderr, "%s: could not initialize medium\n", medium);
+    palloc_close(fd);
+    fclose(trace);
+    return 1;
+  }
+  memset(replay_calls, 0, sizeof(replay_calls));
+
+  start = replay_clock();
+  while((op = fgetc(trace)) != EOF) {
+    if (replay_varint(trace, &delta)) break;
+    recorded += delta;
+
+    if (op == REPLAY_ALLOC) {
+      if (replay_varint(trace, &requested) || replay_varint(trace, &ptr)) break;
+      elapsed = replay_clock();
+      result  = palloc(fd, requested);
+      elapsed = replay_clock() - elapsed;
+      if (!result) failed++;
+      if (ptr && result && replay_map_set(&map, ptr, result)) err = 1;
+      if (replay_latency_add(&allocs, elapsed)) err = 1;
+    } else if (op == REPLAY_FREE) {
+      if (replay_varint(trace, &ptr)) break;
+
+      // Frees of blobs allocated before recording started can't be replayed
+      result = replay_map_get(&map, ptr);
+      if (!result) {
+        unknown++;
+        continue;
+      }
+      replay_map_set(&map, ptr, 0);
+      elapsed = replay_clock();
+      pfree(fd, result);
+      elapsed = replay_clock() - elapsed;
+      if (replay_latency_add(&frees, elapsed)) err = 1;
+    } else {
+      fprintf(stderr, "%s: unknown operation 0x%02x\n", argv[1], op);
+      err = 1;
+    }
+    if (err) break;
+  }
+  elapsed = replay_clock() - start;
+  if (op != EOF) {
+    fprintf(stderr, "%s: truncated or corrupt trace\n", argv[1]);
+    err = 1;
+  }
+  fclose(trace);
+
+  printf("operations %llu in %.3f ms (recorded %.3f ms), %.0f ops/s\n",
+    (unsigned long long)(allocs.length + frees.length),
+    elapsed / 1e6, recorded / 1e6,
+    elapsed ? ((allocs.length + frees.length) * 1e9 / elapsed) : 0.0
+  );
+  replay_latency_report("palloc", &allocs);
+  replay_latency_report("pfree", &frees);
+  if (failed ) printf("failed allocations %llu\n", (unsigned long long)failed);
+  if (unknown) printf("skipped frees of unknown blobs %llu\n", (unsigned long long)unknown);
+  printf("syscalls");
+  for(i = 0; i < REPLAY_CALLS; i++) {
+    printf(" %s %llu", replay_call_names[i], (unsigned long long)replay_calls[i]);
+  }
+  printf("\n");
+  if (palloc_available(fd, &stats) == PALLOC_OK) {
+    printf("medium %llu bytes, free %llu bytes in %llu blocks, largest %llu, fragmentation %.3f\n",
+      (unsigned long long)seek_os(descriptor, 0, SEEK_END),
+      (unsigned long long)stats.free,
+      (unsigned long long)stats.blocks,
+      (unsigned long long)stats.largest,
+      stats.fragmentation
+    );
+  }
+
+  palloc_close(fd);
+  if (argc < 3) unlink_os(medium);
+  free(map.keys);
+  free(map.values);
+  free(allocs.samples);
+  free(frees.samples);
+  return err;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -5,6 +5,7 @@ extern "C" {
 #endif
 
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
 
 #include <errno.h>
 #include <fcntl.h>
@@ -13,9 +14,44 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PALLOC_HAVE_CRC32C_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define PALLOC_HAVE_CRC32C_ARMV8
+#endif
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#if defined(MFD_CLOEXEC)
+#define PALLOC_HAVE_MEMFD
+#endif
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+#define PALLOC_HAVE_PUNCH_HOLE
+#endif
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#if defined(FICLONE)
+#define PALLOC_HAVE_FICLONE
+#endif
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 27)))
+#define PALLOC_HAVE_COPY_FILE_RANGE
+#endif
+#endif
 
 #include "finwo/endian.h"
 #include "finwo/canonical-path.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+// Needs to be AFTER winsock2 which is used for endian.h
+#include <windows.h>
+// windef.h empties these, which palloc uses as names
+#undef near
+#undef far
+#endif
+
 #include "finwo/io.h"
 
 #include "palloc.h"
@@ -36,7 +72,13 @@ extern "C" {
 /*   uint64_t size; */
 /* }; */
 
-#define PALLOC_MARKER_FREE (0x8000000000000000)
+#define PALLOC_MARKER_FREE       (0x8000000000000000)
+#define PALLOC_MARKER_INTERNAL   (0x4000000000000000)
+#define PALLOC_MARKER_COMPRESSED (0x2000000000000000)
+#define PALLOC_MARKER_CHAIN      (0x1000000000000000)
+#define PALLOC_MARKER_HIDDEN     (PALLOC_MARKER_FREE | PALLOC_MARKER_INTERNAL)
+#define PALLOC_MARKER_PENDING    (PALLOC_MARKER_HIDDEN)
+#define PALLOC_MARKER_FLAGS      (PALLOC_MARKER_HIDDEN | PALLOC_MARKER_COMPRESSED | PALLOC_MARKER_CHAIN)
 
 #if defined(_WIN32) || defined(_WIN64)
 #define OPENMODE  (_S_IREAD | _S_IWRITE)
@@ -59,591 +101,3460 @@ struct palloc_fd_info {
   PALLOC_OFFSET first_free;
   PALLOC_SIZE   header_size;
   PALLOC_SIZE   medium_size;
+  struct palloc_extent *extents;
+  int           extents_valid;
+  uint64_t      generation;
+  int           lock_depth;
+  int           lock_type;
+  int           defer;
+  PALLOC_OFFSET *pending;
+  PALLOC_SIZE   pending_len;
+  PALLOC_SIZE   pending_cap;
+  PALLOC_OFFSET handles_table;
+  PALLOC_OFFSET *handles;
+  PALLOC_SIZE   handles_len;
+  PALLOC_SIZE   handles_hint;
+  int           handles_valid;
+  int           record_fd;
+  char          *record_buf;
+  PALLOC_SIZE   record_len;
+  uint64_t      record_time;
+  const struct palloc_backend *backend;
+  void *udata;
 };
 
 struct palloc_fd_info *_fd_info = NULL;
 
-PALLOC_SIZE _palloc_marker(PALLOC_FD fd, PALLOC_OFFSET ptr) {
-  if (!ptr) return 0;
-  PALLOC_SIZE result;
-  seek_os(fd, ptr, SEEK_SET);
-  read_os(fd, &result, sizeof(PALLOC_SIZE));
-  result = PALLOC_BETOH_SIZE(result);
-  return result;
+// Virtual descriptors handed out for non-os backends, counting up from
+// PALLOC_FD_VIRTUAL so they never collide with a real descriptor
+PALLOC_FD _fd_virtual = PALLOC_FD_VIRTUAL - 1;
+
+void          _palloc_flush(struct palloc_fd_info *finfo);
+void          _palloc_handles_reset(struct palloc_fd_info *finfo);
+PALLOC_OFFSET _pfree_link(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr, PALLOC_OFFSET free_prev, PALLOC_OFFSET free_next);
+PALLOC_OFFSET * _palloc_chain_load(struct palloc_fd_info *finfo, PALLOC_OFFSET head, PALLOC_SIZE *size, PALLOC_SIZE *count);
+
+// Tracing {{{
+
+#ifdef PALLOC_TRACE
+
+struct palloc_trace_span {
+  struct palloc_trace event;
+  struct timespec     start;
+  PALLOC_SIZE         visited;
+};
+
+void     (*_palloc_trace_hook)(const struct palloc_trace *event, void *udata) = NULL;
+void     *_palloc_trace_udata = NULL;
+uint64_t _palloc_trace_buckets[PALLOC_TRACE_OPS][PALLOC_TRACE_BUCKETS];
+
+// Free-list and tree nodes or blocks looked at, across all mediums
+PALLOC_SIZE _palloc_trace_visited = 0;
+
+void _palloc_trace_begin(struct palloc_trace_span *span, int op, PALLOC_FD fd, PALLOC_OFFSET ptr, PALLOC_SIZE size) {
+  span->event.op      = op;
+  span->event.done    = 0;
+  span->event.fd      = fd;
+  span->event.ptr     = ptr;
+  span->event.size    = size;
+  span->event.visited = 0;
+  span->event.elapsed = 0;
+  span->visited       = _palloc_trace_visited;
+  if (_palloc_trace_hook) _palloc_trace_hook(&(span->event), _palloc_trace_udata);
+  clock_gettime(CLOCK_MONOTONIC, &(span->start));
 }
 
-PALLOC_SIZE _palloc_size(PALLOC_FD fd, PALLOC_OFFSET ptr) {
-  return _palloc_marker(fd, ptr) & (~PALLOC_MARKER_FREE);
+void _palloc_trace_end(struct palloc_trace_span *span, PALLOC_OFFSET ptr, PALLOC_SIZE size) {
+  struct timespec end;
+  uint64_t        elapsed;
+  int             bucket = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = ((uint64_t)(end.tv_sec - span->start.tv_sec) * 1000000000) + end.tv_nsec - span->start.tv_nsec;
+
+  // Bucket n holds latencies of [2^n, 2^(n+1)) nanoseconds
+  while((bucket < (PALLOC_TRACE_BUCKETS - 1)) && (elapsed >> (bucket + 1))) bucket++;
+  _palloc_trace_buckets[span->event.op][bucket]++;
+
+  span->event.done    = 1;
+  span->event.ptr     = ptr;
+  span->event.size    = size;
+  span->event.visited = _palloc_trace_visited - span->visited;
+  span->event.elapsed = elapsed;
+  if (_palloc_trace_hook) _palloc_trace_hook(&(span->event), _palloc_trace_udata);
 }
 
-struct palloc_fd_info * _palloc_info(PALLOC_FD fd) {
-  PALLOC_OFFSET pos;
-  PALLOC_SIZE   marker;
+#define PALLOC_SPAN(span)                      struct palloc_trace_span span
+#define PALLOC_SPAN_BEGIN(span, op, fd, p, s)  _palloc_trace_begin(&(span), op, fd, p, s)
+#define PALLOC_SPAN_END(span, p, s)            _palloc_trace_end(&(span), p, s)
+#define PALLOC_VISIT()                         (_palloc_trace_visited++)
 
-  // Attempt to fetch cached version
-  struct palloc_fd_info *finfo = _fd_info;
-  while(finfo) {
-    if (finfo->fd == fd) break;
-    finfo = finfo->next;
-  }
+#else
 
-  // Build new if no cached version was found
-  if (!finfo) {
-    finfo       = calloc(1, sizeof(struct palloc_fd_info));
-    finfo->next = _fd_info;
-    finfo->fd   = fd;
-    _fd_info    = finfo;
-
-    // Get the current medium size
-    finfo->medium_size = seek_os(fd, 0, SEEK_END);
-
-    // Pre-bail on new file
-    // All zeroes is accurate here
-    if (!finfo->medium_size) {
-      return finfo;
-    }
-
-    // Detect header size
-    finfo->header_size = expected_header_size + sizeof(PALLOC_FLAGS);
-    char *hdr       = malloc(expected_header_size);
-    seek_os(fd, 0, SEEK_SET);
-    read_os(fd, hdr   , expected_header_size);
-    read_os(fd, &(finfo->flags), sizeof(PALLOC_FLAGS));
-    finfo->flags = PALLOC_BETOH_FLAGS(finfo->flags);
-    if (finfo->flags & PALLOC_EXTENDED) {
-      // Reserved for future use
-      // header_size = bigger
-    }
-    free(hdr);
+#define PALLOC_SPAN(span)
+#define PALLOC_SPAN_BEGIN(span, op, fd, p, s)
+#define PALLOC_SPAN_END(span, p, s)
+#define PALLOC_VISIT()
 
-    // Detect first_free block
-    pos = seek_os(fd, finfo->header_size, SEEK_SET);
-    while(pos < finfo->medium_size) {
-      if (read_os(fd, &marker, sizeof(marker)) != sizeof(marker)) {
-        perror("palloc_info::read");
-        exit(1);
-      }
-      marker = PALLOC_BETOH_SIZE(marker);
-      if (marker & PALLOC_MARKER_FREE) {
-        break;
-      }
-      pos = seek_os(fd, marker + sizeof(marker), SEEK_CUR);
-    }
-    if (pos >= finfo->medium_size) {
-      finfo->first_free = 0;
-    } else {
-      finfo->first_free = pos;
-    }
-  }
+#endif
 
-  return finfo;
-}
 // }}}
 
-PALLOC_FD palloc_open(const char *filename, PALLOC_FLAGS flags) {
+// Recording {{{
 
-  // Try to fetch the canonical path to the filename
-  char *filepath = canonical_path(filename);
-  if (!filepath) {
-    perror("palloc_open::realpath");
-    return 0;
-  }
+// Allocation histories are written as a header followed by records of an
+// operation byte and leb128 varints, see "Record stream structure"
 
-  // Prep real open flags
-  int openFlags = O_RDWR | O_CREAT;
-#if defined(__APPLE__) || defined(_WIN32) || defined(_WIN64)
-  // No O_LARGEFILE needed
+#define PALLOC_RECORD_MAGIC "PBR\0"
+#define PALLOC_RECORD_ALLOC 'a'
+#define PALLOC_RECORD_FREE  'f'
+#define PALLOC_RECORD_SIZE  65536
+
+uint64_t _palloc_record_clock() {
+#if defined(_WIN32) || defined(_WIN64)
+  LARGE_INTEGER now, frequency;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&frequency);
+  return ((uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000000) + (((uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000000) / frequency.QuadPart);
 #else
-  openFlags |= O_LARGEFILE;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
 #endif
-  if (flags & PALLOC_SYNC) {
-    openFlags |= O_DSYNC;
+}
+
+int _palloc_record_flush(struct palloc_fd_info *finfo) {
+  int64_t written = finfo->record_len ? write_os(finfo->record_fd, finfo->record_buf, finfo->record_len) : 0;
+  if (written != (int64_t)finfo->record_len) {
+    perror("palloc_record::write");
+    return -1;
   }
+  finfo->record_len = 0;
+  return 0;
+}
 
-  // Open the file
-  PALLOC_FD fd = open_os(filepath, openFlags, OPENMODE);
-  if (!fd) {
-    perror("palloc_open::open");
-    free(filepath);
-    return 0;
+void _palloc_record_stop(struct palloc_fd_info *finfo) {
+  if (!finfo->record_buf) return;
+  _palloc_record_flush(finfo);
+  close_os(finfo->record_fd);
+  free(finfo->record_buf);
+  finfo->record_buf = NULL;
+  finfo->record_len = 0;
+}
+
+void _palloc_record_varint(struct palloc_fd_info *finfo, uint64_t value) {
+  while(value >= 0x80) {
+    finfo->record_buf[finfo->record_len++] = (value & 0x7F) | 0x80;
+    value >>= 7;
   }
+  finfo->record_buf[finfo->record_len++] = value;
+}
 
-  // Pre-cache info
-  _palloc_info(fd);
+// Appends an operation, size being only recorded for allocations
+void _palloc_record(struct palloc_fd_info *finfo, char op, PALLOC_SIZE size, PALLOC_OFFSET ptr) {
+  uint64_t now;
+  if (!finfo->record_buf) return;
+  if (((PALLOC_RECORD_SIZE - finfo->record_len) < 32) && _palloc_record_flush(finfo)) {
+    _palloc_record_stop(finfo);
+    return;
+  }
+  now = _palloc_record_clock();
+  finfo->record_buf[finfo->record_len++] = op;
+  _palloc_record_varint(finfo, now - finfo->record_time);
+  if (op == PALLOC_RECORD_ALLOC) _palloc_record_varint(finfo, size);
+  _palloc_record_varint(finfo, ptr);
+  finfo->record_time = now;
+}
 
-  free(filepath);
-  return fd;
+// }}}
+
+// Backend: os {{{
+
+int64_t _palloc_os_seek(void *udata, int64_t offset, int whence) {
+  return seek_os((int)(intptr_t)udata, offset, whence);
 }
 
-PALLOC_RESPONSE palloc_close(PALLOC_FD fd) {
+int64_t _palloc_os_read(void *udata, void *buf, PALLOC_SIZE count) {
+  return read_os((int)(intptr_t)udata, buf, count);
+}
 
-  // Free fd info if we have it
-  struct palloc_fd_info *finfo_cur = _fd_info;
-  struct palloc_fd_info *finfo_prv = NULL;
+int64_t _palloc_os_write(void *udata, const void *buf, PALLOC_SIZE count) {
+  return write_os((int)(intptr_t)udata, buf, count);
+}
 
-  while(finfo_cur) {
-    if (finfo_cur->fd == fd) break;
-    finfo_prv = finfo_cur;
-    finfo_cur = finfo_cur->next;
-  }
+int _palloc_os_truncate(void *udata, PALLOC_OFFSET length) {
+  return truncate_os((int)(intptr_t)udata, length);
+}
 
-  if (finfo_cur) {
-    // Point prev to our next
-    if (finfo_prv) finfo_prv->next = finfo_cur->next;
-    else _fd_info = finfo_cur->next;
-    // Free the info
-    free(finfo_cur);
-  }
+int _palloc_os_close(void *udata) {
+  return close_os((int)(intptr_t)udata);
+}
 
-  const int r = close_os(fd);
-  if (r) {
-    perror("close");
-    return PALLOC_ERR;
+#if defined(_WIN32) || defined(_WIN64)
+#define _palloc_os_lock NULL
+#else
+int _palloc_os_lock(void *udata, PALLOC_OFFSET offset, PALLOC_SIZE length, int type) {
+  struct flock lck;
+  memset(&lck, 0, sizeof(lck));
+  lck.l_whence = SEEK_SET;
+  lck.l_start  = offset;
+  lck.l_len    = length;
+  switch(type) {
+    case PALLOC_LOCK_READ : lck.l_type = F_RDLCK; break;
+    case PALLOC_LOCK_WRITE: lck.l_type = F_WRLCK; break;
+    default               : lck.l_type = F_UNLCK; break;
   }
-  return PALLOC_OK;
+  while(fcntl((int)(intptr_t)udata, F_SETLKW, &lck)) {
+    if (errno != EINTR) return -1;
+  }
+  return 0;
 }
+#endif
 
-PALLOC_RESPONSE palloc_init(PALLOC_FD fd, PALLOC_FLAGS flags) {
-  const int min_header_size = expected_header_size + sizeof(PALLOC_FLAGS);
-  const int min_medium_size = min_header_size + (sizeof(PALLOC_SIZE)*2) + (sizeof(PALLOC_OFFSET)*2);
-  char *z = calloc(min_medium_size, 1);
+#if defined(PALLOC_HAVE_PUNCH_HOLE)
+int _palloc_os_punch(void *udata, PALLOC_OFFSET offset, PALLOC_SIZE length) {
+  return fallocate((int)(intptr_t)udata, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
+#else
+#define _palloc_os_punch NULL
+#endif
 
-  // Pre-fetch medium info
-  struct palloc_fd_info *finfo = _palloc_info(fd);
+const struct palloc_backend palloc_backend_os = {
+  .seek     = _palloc_os_seek,
+  .read     = _palloc_os_read,
+  .write    = _palloc_os_write,
+  .truncate = _palloc_os_truncate,
+  .close    = _palloc_os_close,
+  .lock     = _palloc_os_lock,
+  .punch    = _palloc_os_punch,
+};
 
-  // Make sure the medium has room for the header
-  if (finfo->medium_size < min_header_size) {
-    if (flags & PALLOC_DYNAMIC) {
-      seek_os(fd, 0, SEEK_SET);
-      write_os(fd, z, min_header_size);
-      finfo->medium_size = min_header_size;
-      seek_os(fd, 0, SEEK_SET);
-    } else {
-      fprintf(stderr, "Incompatible medium\n");
-      free(z);
-      return PALLOC_ERR;
-    }
-  }
+// }}}
 
-  // Fix broken size
-  if ((finfo->medium_size > min_header_size) && (finfo->medium_size < min_medium_size)) {
-    if (flags & PALLOC_DYNAMIC) {
-      seek_os(fd, min_header_size, SEEK_SET);
-      write_os(fd, z, min_medium_size - min_header_size);
-      finfo->medium_size = min_medium_size;
-      seek_os(fd, 0, SEEK_SET);
-    } else {
-      fprintf(stderr, "Incompatible medium\n");
-      free(z);
-      return PALLOC_ERR;
-    }
-  }
+// Backend: memory {{{
 
-  // Actually read the header
-  char *hdr  = malloc(min_header_size);
-  seek_os(fd, 0, SEEK_SET);
-  if (read_os(fd, hdr, min_header_size) != min_header_size) {
-    perror("palloc_init::read");
-    free(z);
-    free(hdr);
-    return PALLOC_ERR;
-  }
+struct palloc_memory {
+  char          *data;
+  PALLOC_SIZE   size;
+  PALLOC_SIZE   capacity;
+  PALLOC_OFFSET position;
+};
 
-  // Bail early if already initialized
-  if (memcmp(hdr, expected_header, expected_header_size) == 0) {
-    free(z);
-    free(hdr);
-    return PALLOC_OK;
-  }
+int _palloc_memory_reserve(struct palloc_memory *mem, PALLOC_SIZE size) {
+  PALLOC_SIZE capacity = mem->capacity ? mem->capacity : 4096;
+  char *data;
+  if (size <= mem->capacity) return 0;
+  while(capacity < size) capacity *= 2;
+  data = realloc(mem->data, capacity);
+  if (!data) return -1;
+  mem->data     = data;
+  mem->capacity = capacity;
+  return 0;
+}
 
-  // Build & write new header
-  finfo->flags        = flags;
-  PALLOC_FLAGS nflags = PALLOC_HTOBE_FLAGS(finfo->flags & (~PALLOC_SYNC));
-  memcpy(hdr, expected_header, expected_header_size);
-  memcpy(hdr + expected_header_size, &nflags, sizeof(PALLOC_FLAGS));
-  seek_os(fd, 0, SEEK_SET);
-  if (write_os(fd, hdr, min_header_size) != min_header_size) {
-    perror("palloc_init::write_header");
-    free(z);
-    free(hdr);
-    return PALLOC_ERR;
+int _palloc_memory_resize(struct palloc_memory *mem, PALLOC_SIZE size) {
+  if (_palloc_memory_reserve(mem, size)) return -1;
+  if (size > mem->size) {
+    memset(mem->data + mem->size, 0, size - mem->size);
   }
+  mem->size = size;
+  return 0;
+}
 
-  // Keep track of header size
-  if (min_header_size > finfo->header_size) {
-    finfo->header_size = min_header_size;
+int64_t _palloc_memory_seek(void *udata, int64_t offset, int whence) {
+  struct palloc_memory *mem = udata;
+  int64_t base = 0;
+  if (whence == SEEK_CUR) base = mem->position;
+  if (whence == SEEK_END) base = mem->size;
+  if ((base + offset) < 0) {
+    errno = EINVAL;
+    return -1;
   }
+  mem->position = base + offset;
+  return mem->position;
+}
 
-  // Mark remainder of medium free
-  if (finfo->medium_size >= min_medium_size) {
-    PALLOC_SIZE   marker = PALLOC_HTOBE_SIZE((PALLOC_SIZE)((finfo->medium_size - min_header_size - (sizeof(PALLOC_SIZE)*2)) | PALLOC_MARKER_FREE));
-    PALLOC_OFFSET ptr    = PALLOC_HTOBE_OFFSET((PALLOC_OFFSET)0);
-    seek_os(fd, finfo->header_size, SEEK_SET);
-    finfo->first_free = finfo->header_size;
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc_init::write_marker_start");
-      free(z);
-      free(hdr);
-      return PALLOC_ERR;
-    }
-    if (write_os(fd, &ptr, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
-      perror("palloc_init::write_ptr_prev");
-      free(z);
-      free(hdr);
-      return PALLOC_ERR;
-    }
-    if (write_os(fd, &ptr, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
-      perror("palloc_init::write_ptr_next");
-      free(z);
-      free(hdr);
-      return PALLOC_ERR;
-    }
-    seek_os(fd, 0 - sizeof(PALLOC_SIZE), SEEK_END);
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc_init::write_marker_end");
-      free(z);
-      free(hdr);
-      return PALLOC_ERR;
+int64_t _palloc_memory_read(void *udata, void *buf, PALLOC_SIZE count) {
+  struct palloc_memory *mem = udata;
+  if (mem->position >= mem->size) return 0;
+  count = MIN(count, mem->size - mem->position);
+  memcpy(buf, mem->data + mem->position, count);
+  mem->position += count;
+  return count;
+}
+
+int64_t _palloc_memory_write(void *udata, const void *buf, PALLOC_SIZE count) {
+  struct palloc_memory *mem = udata;
+  if ((mem->position + count) > mem->size) {
+    if (_palloc_memory_resize(mem, mem->position + count)) {
+      errno = ENOMEM;
+      return -1;
     }
   }
+  memcpy(mem->data + mem->position, buf, count);
+  mem->position += count;
+  return count;
+}
 
-  free(z);
-  free(hdr);
-  return PALLOC_OK;
+int _palloc_memory_truncate(void *udata, PALLOC_OFFSET length) {
+  struct palloc_memory *mem = udata;
+  if (_palloc_memory_resize(mem, length)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
 }
 
-PALLOC_OFFSET palloc(PALLOC_FD fd, PALLOC_SIZE size) {
-  struct palloc_fd_info *finfo = _palloc_info(fd);
+int _palloc_memory_close(void *udata) {
+  struct palloc_memory *mem = udata;
+  free(mem->data);
+  free(mem);
+  return 0;
+}
 
-  PALLOC_SIZE marker, selected_size;
-  PALLOC_OFFSET free_prev = 0, free_pprev = 0;
-  PALLOC_OFFSET free_next = 0, free_nnext = 0;
+const struct palloc_backend palloc_backend_memory = {
+  .seek     = _palloc_memory_seek,
+  .read     = _palloc_memory_read,
+  .write    = _palloc_memory_write,
+  .truncate = _palloc_memory_truncate,
+  .close    = _palloc_memory_close,
+};
 
-  // Handle minimum size
-  if (size < (sizeof(PALLOC_OFFSET)*2)) {
-    size = sizeof(PALLOC_OFFSET) * 2;
-  }
+// }}}
 
-  // Iterate free blocks to find one that'll fit
-  PALLOC_OFFSET selected = finfo->first_free;
-  while(selected && (_palloc_size(fd, selected) < size)) {
-    free_prev = selected;
-    seek_os(fd, selected + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
-    read_os(fd, &selected, sizeof(PALLOC_OFFSET));
-    selected = PALLOC_BETOH_OFFSET(selected);
-  }
+// Storage access {{{
 
-  // Handle full(-ish) medium when not dynamic
-  if ((!selected) && (!(finfo->flags & PALLOC_DYNAMIC))) {
-    return 0;
-  }
+int64_t _palloc_seek(struct palloc_fd_info *finfo, int64_t offset, int whence) {
+  return finfo->backend->seek(finfo->udata, offset, whence);
+}
 
-  // Allocate new space if dynamic and needed
-  if (!selected) {
-    marker    = PALLOC_HTOBE_SIZE(size | PALLOC_MARKER_FREE);
-    free_prev = PALLOC_HTOBE_OFFSET(free_prev);
-    selected  = seek_os(fd, 0, SEEK_END);
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc::write");
-      return 0;
-    }
-    if (write_os(fd, &free_prev, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
-      perror("palloc::write");
-      return 0;
-    }
-    free_prev = PALLOC_BETOH_OFFSET(free_prev);
-    seek_os(fd, size - sizeof(PALLOC_OFFSET), SEEK_CUR);
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc::write");
-      return 0;
-    }
-    finfo->first_free  = selected;
-    finfo->medium_size = seek_os(fd, 0, SEEK_CUR);
-  }
+int64_t _palloc_read(struct palloc_fd_info *finfo, void *buf, PALLOC_SIZE count) {
+  return finfo->backend->read(finfo->udata, buf, count);
+}
 
-  // Fetch selected block info
-  marker = _palloc_marker(fd, selected);
-  selected_size = _palloc_size(fd, selected);
+int64_t _palloc_write(struct palloc_fd_info *finfo, const void *buf, PALLOC_SIZE count) {
+  return finfo->backend->write(finfo->udata, buf, count);
+}
 
-  // Split block if large enough
-  // marker,free_next,free_prev & fd position are dirty after this
-  if ((selected_size - size) > ((sizeof(PALLOC_SIZE)*2)+(sizeof(PALLOC_OFFSET)*2))) {
-    marker    = PALLOC_HTOBE_SIZE(size | PALLOC_MARKER_FREE);
-    free_next = PALLOC_HTOBE_OFFSET(selected + size + (sizeof(PALLOC_SIZE)*2));
-    free_prev = PALLOC_HTOBE_OFFSET(selected);
-    // Update selected block
-    seek_os(fd, selected, SEEK_SET);
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc::write");
-      return 0;
-    }
-    seek_os(fd, sizeof(PALLOC_OFFSET), SEEK_CUR);
-    read_os(fd, &free_nnext, sizeof(PALLOC_OFFSET));
-    seek_os(fd, 0 - sizeof(PALLOC_OFFSET), SEEK_CUR);
-    if (write_os(fd, &free_next, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
-      perror("palloc::write");
-      return 0;
-    }
-    seek_os(fd, size - (sizeof(PALLOC_OFFSET)*2), SEEK_CUR);
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc::write");
+int _palloc_truncate(struct palloc_fd_info *finfo, PALLOC_OFFSET length) {
+  return finfo->backend->truncate(finfo->udata, length);
+}
+
+PALLOC_SIZE _palloc_marker(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr) {
+  if (!ptr) return 0;
+  PALLOC_SIZE result;
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  _palloc_read(finfo, &result, sizeof(PALLOC_SIZE));
+  result = PALLOC_BETOH_SIZE(result);
+  return result;
+}
+
+PALLOC_SIZE _palloc_size(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr) {
+  return _palloc_marker(finfo, ptr) & (~PALLOC_MARKER_FLAGS);
+}
+
+// Buffered forward reader, for passes that walk the whole medium
+struct palloc_stream {
+  struct palloc_fd_info *finfo;
+  char          *buf;
+  PALLOC_SIZE   capacity;
+  PALLOC_OFFSET start;
+  PALLOC_SIZE   length;
+};
+
+#define PALLOC_STREAM_SIZE (1024*1024)
+
+// Returns a pointer to count bytes at offset, or NULL if those could not be
+// read. Count may not exceed the stream's capacity.
+const char * _palloc_stream_peek(struct palloc_stream *stream, PALLOC_OFFSET offset, PALLOC_SIZE count) {
+  int64_t n;
+  if ((offset >= stream->start) && ((offset + count) <= (stream->start + stream->length))) {
+    return stream->buf + (offset - stream->start);
+  }
+  if (count > stream->capacity) return NULL;
+  stream->start  = offset;
+  stream->length = 0;
+  if (_palloc_seek(stream->finfo, offset, SEEK_SET) < 0) return NULL;
+  while(stream->length < stream->capacity) {
+    n = _palloc_read(stream->finfo, stream->buf + stream->length, stream->capacity - stream->length);
+    if (n <= 0) break;
+    stream->length += n;
+  }
+  if (stream->length < count) return NULL;
+  return stream->buf;
+}
+
+// }}}
+
+// Checksums {{{
+
+uint32_t _palloc_crc32c_table[256];
+
+uint32_t _palloc_crc32c_sw(uint32_t crc, const unsigned char *buf, PALLOC_SIZE len) {
+  int i, j;
+  if (!_palloc_crc32c_table[1]) {
+    for(i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for(j = 0; j < 8; j++) {
+        c = (c & 1) ? ((c >> 1) ^ 0x82F63B78) : (c >> 1);
+      }
+      _palloc_crc32c_table[i] = c;
+    }
+  }
+  while(len--) {
+    crc = _palloc_crc32c_table[(crc ^ *(buf++)) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(PALLOC_HAVE_CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+uint32_t _palloc_crc32c_hw(uint32_t crc, const unsigned char *buf, PALLOC_SIZE len) {
+  uint64_t c = crc, word;
+  while(len >= sizeof(word)) {
+    memcpy(&word, buf, sizeof(word));
+    c    = __builtin_ia32_crc32di(c, word);
+    buf += sizeof(word);
+    len -= sizeof(word);
+  }
+  crc = c;
+  while(len--) crc = __builtin_ia32_crc32qi(crc, *(buf++));
+  return crc;
+}
+#elif defined(PALLOC_HAVE_CRC32C_ARMV8)
+uint32_t _palloc_crc32c_hw(uint32_t crc, const unsigned char *buf, PALLOC_SIZE len) {
+  uint64_t word;
+  while(len >= sizeof(word)) {
+    memcpy(&word, buf, sizeof(word));
+    crc  = __crc32cd(crc, word);
+    buf += sizeof(word);
+    len -= sizeof(word);
+  }
+  while(len--) crc = __crc32cb(crc, *(buf++));
+  return crc;
+}
+#endif
+
+// Continues a crc32c, start with crc 0
+uint32_t _palloc_crc32c(uint32_t crc, const void *buf, PALLOC_SIZE len) {
+  crc = ~crc;
+#if defined(PALLOC_HAVE_CRC32C_SSE42)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return ~_palloc_crc32c_hw(crc, buf, len);
+  }
+#elif defined(PALLOC_HAVE_CRC32C_ARMV8)
+  return ~_palloc_crc32c_hw(crc, buf, len);
+#endif
+  return ~_palloc_crc32c_sw(crc, buf, len);
+}
+
+// Size of the check slot at the end of every block's data section
+PALLOC_SIZE _palloc_check_size(struct palloc_fd_info *finfo) {
+  return (finfo->flags & PALLOC_CHECKSUM) ? sizeof(uint64_t) : 0;
+}
+
+// Checksum of a block's markers, bound to the block's location
+uint32_t _palloc_check_marker(PALLOC_OFFSET block, PALLOC_SIZE marker) {
+  uint64_t buf[2] = { htobe64(block), htobe64(marker) };
+  return _palloc_crc32c(0, buf, sizeof(buf));
+}
+
+// Checksum of a blob's data, 0 is reserved for unsealed blobs
+uint32_t _palloc_check_payload(uint32_t crc) {
+  return crc ? crc : 1;
+}
+
+// Writes the check slot for freshly written markers
+// Any payload checksum is dropped, as the blob's data is no longer sealed
+void _palloc_seal(struct palloc_fd_info *finfo, PALLOC_OFFSET block, PALLOC_SIZE marker) {
+  if (!(finfo->flags & PALLOC_CHECKSUM)) return;
+  uint64_t check = htobe64(_palloc_check_marker(block, marker));
+  _palloc_seek(finfo, block + (marker & (~PALLOC_MARKER_FLAGS)), SEEK_SET);
+  if (_palloc_write(finfo, &check, sizeof(check)) != sizeof(check)) {
+    perror("palloc_seal::write");
+  }
+}
+
+// Whether a block's marker can be trusted to point at the next block
+int _palloc_intact(struct palloc_fd_info *finfo, PALLOC_OFFSET block, PALLOC_SIZE marker) {
+  PALLOC_SIZE size = marker & (~PALLOC_MARKER_FLAGS);
+  uint64_t check;
+  if (size < ((sizeof(PALLOC_OFFSET)*2) + _palloc_check_size(finfo))) return 0;
+  if (size > finfo->medium_size) return 0;
+  if ((block + size + (sizeof(PALLOC_SIZE)*2)) > finfo->medium_size) return 0;
+  if (!(finfo->flags & PALLOC_CHECKSUM)) return 1;
+  _palloc_seek(finfo, block + size, SEEK_SET);
+  if (_palloc_read(finfo, &check, sizeof(check)) != sizeof(check)) return 0;
+  return (be64toh(check) & 0xFFFFFFFF) == _palloc_check_marker(block, marker);
+}
+
+// }}}
+
+// Compression {{{
+
+// Built-in LZ77 codec, using the lz4 block format: sequences of a token
+// holding the literal and match length, the literals, a 2-byte match offset
+// and length continuations, ending in a sequence of literals only
+
+#define PALLOC_LZ_HASH_BITS 12
+#define PALLOC_LZ_MIN_MATCH 4
+#define PALLOC_LZ_LAST      12
+
+uint32_t _palloc_lz_read32(const unsigned char *ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+unsigned char * _palloc_lz_length(unsigned char *op, PALLOC_SIZE length) {
+  while(length >= 255) {
+    *(op++) = 255;
+    length -= 255;
+  }
+  *(op++) = length;
+  return op;
+}
+
+// Returns the compressed length, or 0 if it would exceed capacity
+PALLOC_SIZE _palloc_lz_compress(const unsigned char *src, PALLOC_SIZE length, unsigned char *dst, PALLOC_SIZE capacity) {
+  uint32_t            table[1 << PALLOC_LZ_HASH_BITS];
+  const unsigned char *ip     = src;
+  const unsigned char *anchor = src;
+  const unsigned char *iend   = src + length;
+  const unsigned char *limit  = (length > PALLOC_LZ_LAST) ? (iend - PALLOC_LZ_LAST) : src;
+  const unsigned char *ref;
+  unsigned char       *op     = dst;
+  unsigned char       *oend   = dst + capacity;
+  unsigned char       *token;
+  PALLOC_SIZE         literals, match;
+  uint32_t            hash;
+
+  memset(table, 0, sizeof(table));
+  while(ip < limit) {
+    hash        = (_palloc_lz_read32(ip) * 2654435761U) >> (32 - PALLOC_LZ_HASH_BITS);
+    ref         = src + table[hash];
+    table[hash] = ip - src;
+    if ((ref >= ip) || ((ip - ref) > 65535) || (_palloc_lz_read32(ref) != _palloc_lz_read32(ip))) {
+      ip++;
+      continue;
+    }
+
+    // Matches stop short of the end, which is always literals
+    match = PALLOC_LZ_MIN_MATCH;
+    while(((ip + match) < (iend - 5)) && (ref[match] == ip[match])) match++;
+    literals = ip - anchor;
+    if ((oend - op) < (PALLOC_SIZE)(literals + (literals / 255) + (match / 255) + 5)) return 0;
+
+    token = op++;
+    *token = (MIN(literals, 15) << 4) | MIN(match - PALLOC_LZ_MIN_MATCH, 15);
+    if (literals >= 15) op = _palloc_lz_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    *(op++) = (ip - ref) & 0xFF;
+    *(op++) = (ip - ref) >> 8;
+    if ((match - PALLOC_LZ_MIN_MATCH) >= 15) op = _palloc_lz_length(op, match - PALLOC_LZ_MIN_MATCH - 15);
+    ip    += match;
+    anchor = ip;
+  }
+
+  literals = iend - anchor;
+  if ((oend - op) < (PALLOC_SIZE)(literals + (literals / 255) + 2)) return 0;
+  token  = op++;
+  *token = MIN(literals, 15) << 4;
+  if (literals >= 15) op = _palloc_lz_length(op, literals - 15);
+  memcpy(op, anchor, literals);
+  op += literals;
+  return op - dst;
+}
+
+// Returns the decompressed length, or -1 on malformed input
+int64_t _palloc_lz_decompress(const unsigned char *src, PALLOC_SIZE length, unsigned char *dst, PALLOC_SIZE capacity) {
+  const unsigned char *ip   = src;
+  const unsigned char *iend = src + length;
+  unsigned char       *op   = dst;
+  unsigned char       *oend = dst + capacity;
+  const unsigned char *ref;
+  PALLOC_SIZE         literals, match, offset;
+  unsigned char       token, byte;
+
+  while(ip < iend) {
+    token    = *(ip++);
+    literals = token >> 4;
+    if (literals == 15) {
+      do {
+        if (ip >= iend) return -1;
+        byte      = *(ip++);
+        literals += byte;
+      } while(byte == 255);
+    }
+    if ((literals > (PALLOC_SIZE)(iend - ip)) || (literals > (PALLOC_SIZE)(oend - op))) return -1;
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+    if (ip == iend) break;
+
+    if ((iend - ip) < 2) return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip    += 2;
+    if (!offset || (offset > (PALLOC_SIZE)(op - dst))) return -1;
+    match = token & 15;
+    if (match == 15) {
+      do {
+        if (ip >= iend) return -1;
+        byte   = *(ip++);
+        match += byte;
+      } while(byte == 255);
+    }
+    match += PALLOC_LZ_MIN_MATCH;
+    if (match > (PALLOC_SIZE)(oend - op)) return -1;
+
+    // Overlapping matches repeat their own output
+    ref = op - offset;
+    if (offset >= match) {
+      memcpy(op, ref, match);
+      op += match;
+    } else {
+      while(match--) *(op++) = *(ref++);
+    }
+  }
+
+  return op - dst;
+}
+
+// }}}
+
+// Free extents {{{
+
+// In-memory copy of the free list, as a treap ordered by offset where every
+// node knows the largest free block, total size and block count within it's
+// subtree. The free list on the medium remains authoritative, this is only a
+// write-through cache.
+struct palloc_extent {
+  struct palloc_extent *left;
+  struct palloc_extent *right;
+  PALLOC_OFFSET offset;
+  PALLOC_SIZE   size;
+  PALLOC_SIZE   max;
+  PALLOC_SIZE   total;
+  PALLOC_SIZE   count;
+  uint32_t      priority;
+};
+
+uint32_t _palloc_extent_seed = 2463534242;
+
+void _palloc_extent_update(struct palloc_extent *node) {
+  node->max   = node->size;
+  node->total = node->size;
+  node->count = 1;
+  if (node->left) {
+    node->max    = MAX(node->max, node->left->max);
+    node->total += node->left->total;
+    node->count += node->left->count;
+  }
+  if (node->right) {
+    node->max    = MAX(node->max, node->right->max);
+    node->total += node->right->total;
+    node->count += node->right->count;
+  }
+}
+
+// Splits a tree into nodes before offset and nodes at or after offset
+void _palloc_extent_split(struct palloc_extent *tree, PALLOC_OFFSET offset, struct palloc_extent **left, struct palloc_extent **right) {
+  if (!tree) {
+    *left  = NULL;
+    *right = NULL;
+  } else if (tree->offset < offset) {
+    _palloc_extent_split(tree->right, offset, &(tree->right), right);
+    _palloc_extent_update(tree);
+    *left = tree;
+  } else {
+    _palloc_extent_split(tree->left, offset, left, &(tree->left));
+    _palloc_extent_update(tree);
+    *right = tree;
+  }
+}
+
+// Joins two trees, where all of left comes before all of right
+struct palloc_extent * _palloc_extent_join(struct palloc_extent *left, struct palloc_extent *right) {
+  if (!left ) return right;
+  if (!right) return left;
+  if (left->priority > right->priority) {
+    left->right = _palloc_extent_join(left->right, right);
+    _palloc_extent_update(left);
+    return left;
+  }
+  right->left = _palloc_extent_join(left, right->left);
+  _palloc_extent_update(right);
+  return right;
+}
+
+void _palloc_extent_free(struct palloc_extent *tree) {
+  if (!tree) return;
+  _palloc_extent_free(tree->left);
+  _palloc_extent_free(tree->right);
+  free(tree);
+}
+
+void _palloc_extent_reset(struct palloc_fd_info *finfo) {
+  _palloc_extent_free(finfo->extents);
+  finfo->extents       = NULL;
+  finfo->extents_valid = 0;
+}
+
+void _palloc_extent_insert(struct palloc_fd_info *finfo, PALLOC_OFFSET offset, PALLOC_SIZE size) {
+  struct palloc_extent *left, *right, *node;
+  if (!finfo->extents_valid) return;
+  node = calloc(1, sizeof(struct palloc_extent));
+  if (!node) {
+    // Falling back to re-reading the free list beats a wrong cache
+    _palloc_extent_reset(finfo);
+    return;
+  }
+  _palloc_extent_seed ^= _palloc_extent_seed << 13;
+  _palloc_extent_seed ^= _palloc_extent_seed >> 17;
+  _palloc_extent_seed ^= _palloc_extent_seed << 5;
+  node->offset   = offset;
+  node->size     = size;
+  node->priority = _palloc_extent_seed;
+  _palloc_extent_update(node);
+  _palloc_extent_split(finfo->extents, offset, &left, &right);
+  finfo->extents = _palloc_extent_join(_palloc_extent_join(left, node), right);
+}
+
+void _palloc_extent_remove(struct palloc_fd_info *finfo, PALLOC_OFFSET offset) {
+  struct palloc_extent *left, *middle, *right;
+  if (!finfo->extents_valid) return;
+  _palloc_extent_split(finfo->extents, offset, &left, &right);
+  _palloc_extent_split(right, offset + 1, &middle, &right);
+  _palloc_extent_free(middle);
+  finfo->extents = _palloc_extent_join(left, right);
+}
+
+void _palloc_extent_resize(struct palloc_extent *tree, PALLOC_OFFSET offset, PALLOC_SIZE size) {
+  if (!tree) return;
+  if      (offset < tree->offset) _palloc_extent_resize(tree->left , offset, size);
+  else if (offset > tree->offset) _palloc_extent_resize(tree->right, offset, size);
+  else                            tree->size = size;
+  _palloc_extent_update(tree);
+}
+
+// Lowest-offset extent of at least size bytes, matching the free list walk
+struct palloc_extent * _palloc_extent_fit(struct palloc_extent *tree, PALLOC_SIZE size) {
+  while(tree && (tree->max >= size)) {
+    PALLOC_VISIT();
+    if (tree->left && (tree->left->max >= size)) {
+      tree = tree->left;
+    } else if (tree->size >= size) {
+      return tree;
+    } else {
+      tree = tree->right;
+    }
+  }
+  return NULL;
+}
+
+// Lowest-offset extent at or after offset of at least size bytes
+struct palloc_extent * _palloc_extent_fit_after(struct palloc_extent *tree, PALLOC_SIZE size, PALLOC_OFFSET offset) {
+  struct palloc_extent *found;
+  if (!tree || (tree->max < size)) return NULL;
+  PALLOC_VISIT();
+  if (tree->offset < offset) return _palloc_extent_fit_after(tree->right, size, offset);
+  found = _palloc_extent_fit_after(tree->left, size, offset);
+  if (found) return found;
+  if (tree->size >= size) return tree;
+  return _palloc_extent_fit(tree->right, size);
+}
+
+// Highest-offset extent before offset of at least size bytes
+struct palloc_extent * _palloc_extent_fit_before(struct palloc_extent *tree, PALLOC_SIZE size, PALLOC_OFFSET offset) {
+  struct palloc_extent *found;
+  if (!tree || (tree->max < size)) return NULL;
+  PALLOC_VISIT();
+  if (tree->offset >= offset) return _palloc_extent_fit_before(tree->left, size, offset);
+  found = _palloc_extent_fit_before(tree->right, size, offset);
+  if (found) return found;
+  if (tree->size >= size) return tree;
+  return _palloc_extent_fit_before(tree->left, size, offset);
+}
+
+// Extent starting at exactly offset
+struct palloc_extent * _palloc_extent_find(struct palloc_extent *tree, PALLOC_OFFSET offset) {
+  while(tree && (tree->offset != offset)) {
+    tree = (offset < tree->offset) ? tree->left : tree->right;
+  }
+  return tree;
+}
+
+// Extent with the highest offset
+struct palloc_extent * _palloc_extent_last(struct palloc_extent *tree) {
+  while(tree && tree->right) tree = tree->right;
+  return tree;
+}
+
+// Closest extent before offset
+PALLOC_OFFSET _palloc_extent_prev(struct palloc_extent *tree, PALLOC_OFFSET offset) {
+  PALLOC_OFFSET found = 0;
+  while(tree) {
+    PALLOC_VISIT();
+    if (tree->offset < offset) {
+      found = tree->offset;
+      tree  = tree->right;
+    } else {
+      tree  = tree->left;
+    }
+  }
+  return found;
+}
+
+// Closest extent after offset
+PALLOC_OFFSET _palloc_extent_next(struct palloc_extent *tree, PALLOC_OFFSET offset) {
+  PALLOC_OFFSET found = 0;
+  while(tree) {
+    PALLOC_VISIT();
+    if (tree->offset > offset) {
+      found = tree->offset;
+      tree  = tree->left;
+    } else {
+      tree  = tree->right;
+    }
+  }
+  return found;
+}
+
+// Builds the cache from the free list on the medium, if not built yet
+void _palloc_extent_build(struct palloc_fd_info *finfo) {
+  PALLOC_OFFSET block = finfo->first_free;
+  uint64_t      buf[3];
+  if (finfo->extents_valid) return;
+  finfo->extents_valid = 1;
+  while(block) {
+    PALLOC_VISIT();
+    _palloc_seek(finfo, block, SEEK_SET);
+    if (_palloc_read(finfo, buf, sizeof(buf)) != sizeof(buf)) break;
+    _palloc_extent_insert(finfo, block, PALLOC_BETOH_SIZE(buf[0]) & (~PALLOC_MARKER_FLAGS));
+    if (!finfo->extents_valid) return;
+    block = PALLOC_BETOH_OFFSET(buf[2]);
+  }
+}
+
+// }}}
+
+// Medium info {{{
+
+PALLOC_SIZE _palloc_header_size(PALLOC_FLAGS flags) {
+  PALLOC_SIZE size = expected_header_size + sizeof(PALLOC_FLAGS);
+  if (flags & PALLOC_SHARED) {
+    size += sizeof(uint64_t) + sizeof(PALLOC_OFFSET);
+  }
+  if (flags & PALLOC_HANDLES) {
+    size += sizeof(PALLOC_OFFSET);
+  }
+  return size;
+}
+
+// Re-reads the medium state other processes may have changed, if the
+// generation in the header shows our cached version is stale
+void _palloc_refresh(struct palloc_fd_info *finfo) {
+  uint64_t      generation;
+  PALLOC_OFFSET first_free;
+  _palloc_seek(finfo, expected_header_size + sizeof(PALLOC_FLAGS), SEEK_SET);
+  if (_palloc_read(finfo, &generation, sizeof(generation)) != sizeof(generation)) return;
+  if (_palloc_read(finfo, &first_free, sizeof(first_free)) != sizeof(first_free)) return;
+  generation = be64toh(generation);
+  if (generation == finfo->generation) return;
+  finfo->generation  = generation;
+  finfo->first_free  = PALLOC_BETOH_OFFSET(first_free);
+  _palloc_extent_reset(finfo);
+  _palloc_handles_reset(finfo);
+  finfo->medium_size = _palloc_seek(finfo, 0, SEEK_END);
+}
+
+// Generation as currently in the header, ~0 if unreadable
+uint64_t _palloc_generation(struct palloc_fd_info *finfo) {
+  uint64_t generation;
+  _palloc_seek(finfo, expected_header_size + sizeof(PALLOC_FLAGS), SEEK_SET);
+  if (_palloc_read(finfo, &generation, sizeof(generation)) != sizeof(generation)) return ~((uint64_t)0);
+  return be64toh(generation);
+}
+
+// Makes the generation odd while we modify the medium, so readers without
+// a lock know not to trust what they read. Already odd means a writer died
+// mid-way, which we skip past.
+void _palloc_begin(struct palloc_fd_info *finfo) {
+  uint64_t generation = htobe64(finfo->generation = (finfo->generation + 1) | 1);
+  _palloc_seek(finfo, expected_header_size + sizeof(PALLOC_FLAGS), SEEK_SET);
+  _palloc_write(finfo, &generation, sizeof(generation));
+}
+
+// Writes our medium state into the header for other processes to pick up
+void _palloc_publish(struct palloc_fd_info *finfo) {
+  uint64_t      generation = htobe64(++(finfo->generation));
+  PALLOC_OFFSET first_free = PALLOC_HTOBE_OFFSET(finfo->first_free);
+  _palloc_seek(finfo, expected_header_size + sizeof(PALLOC_FLAGS), SEEK_SET);
+  _palloc_write(finfo, &generation, sizeof(generation));
+  _palloc_write(finfo, &first_free, sizeof(first_free));
+}
+
+// Locks the header, which guards the free list, for the duration of an
+// operation on a shared medium. Nested calls only lock once. A held read
+// lock is never upgraded, as two readers upgrading at once deadlock, so
+// paths that may write take the write lock up front.
+int _palloc_lock(struct palloc_fd_info *finfo, int type) {
+  if (!(finfo->flags & PALLOC_SHARED)) return 0;
+  if (finfo->lock_depth) {
+    if ((type == PALLOC_LOCK_WRITE) && (finfo->lock_type != PALLOC_LOCK_WRITE)) {
+      fprintf(stderr, "palloc_lock: write nested in a read lock\n");
+      return -1;
+    }
+    finfo->lock_depth++;
+    return 0;
+  }
+  if (finfo->backend->lock) {
+    if (finfo->backend->lock(finfo->udata, 0, finfo->header_size, type)) {
+      perror("palloc_lock");
+      return -1;
+    }
+  }
+  finfo->lock_depth = 1;
+  finfo->lock_type  = type;
+  _palloc_refresh(finfo);
+  if (type == PALLOC_LOCK_WRITE) {
+    _palloc_begin(finfo);
+  }
+  return 0;
+}
+
+// Publishes when the outermost lock was a write lock
+void _palloc_unlock(struct palloc_fd_info *finfo, int type) {
+  if (!(finfo->flags & PALLOC_SHARED)) return;
+  if (--finfo->lock_depth) return;
+  if (finfo->lock_type == PALLOC_LOCK_WRITE) {
+    _palloc_publish(finfo);
+  }
+  finfo->lock_type = PALLOC_LOCK_UNLOCK;
+  if (finfo->backend->lock) {
+    if (finfo->backend->lock(finfo->udata, 0, finfo->header_size, PALLOC_LOCK_UNLOCK)) {
+      perror("palloc_unlock");
+    }
+  }
+}
+
+void _palloc_scan(struct palloc_fd_info *finfo) {
+  PALLOC_OFFSET pos;
+  PALLOC_SIZE   marker;
+
+  // Free extents get re-read from the new state on first use
+  _palloc_extent_reset(finfo);
+  _palloc_handles_reset(finfo);
+
+  // Get the current medium size
+  finfo->medium_size = _palloc_seek(finfo, 0, SEEK_END);
+
+  // Pre-bail on new file
+  // All zeroes is accurate here
+  if (!finfo->medium_size) {
+    return;
+  }
+
+  // Uninitialized mediums have nothing to detect
+  char *hdr       = malloc(expected_header_size);
+  _palloc_seek(finfo, 0, SEEK_SET);
+  if (
+    (_palloc_read(finfo, hdr, expected_header_size) != expected_header_size) ||
+    (memcmp(hdr, expected_header, expected_header_size) != 0)
+  ) {
+    free(hdr);
+    return;
+  }
+  free(hdr);
+
+  // Detect header size
+  _palloc_read(finfo, &(finfo->flags), sizeof(PALLOC_FLAGS));
+  finfo->flags = PALLOC_BETOH_FLAGS(finfo->flags);
+  finfo->header_size = _palloc_header_size(finfo->flags);
+  if (finfo->flags & PALLOC_EXTENDED) {
+    // Reserved for future use
+    // header_size = bigger
+  }
+
+  // Shared mediums keep their first_free block in the header
+  if (finfo->flags & PALLOC_SHARED) {
+    finfo->generation = ~((uint64_t)0);
+    _palloc_refresh(finfo);
+    return;
+  }
+
+  // Detect first_free block
+  pos = _palloc_seek(finfo, finfo->header_size, SEEK_SET);
+  while(pos < finfo->medium_size) {
+    PALLOC_VISIT();
+    if (_palloc_read(finfo, &marker, sizeof(marker)) != sizeof(marker)) {
+      fprintf(stderr, "palloc_info: truncated block at %llu\n", (unsigned long long)pos);
+      pos = finfo->medium_size;
+      break;
+    }
+    marker = PALLOC_BETOH_SIZE(marker);
+    if (!_palloc_intact(finfo, pos, marker)) {
+      fprintf(stderr, "palloc_info: corrupt block at %llu\n", (unsigned long long)pos);
+      pos = finfo->medium_size;
+      break;
+    }
+    // Deferred frees are free but not linked, so can't start the list
+    if ((marker & PALLOC_MARKER_HIDDEN) == PALLOC_MARKER_FREE) {
+      break;
+    }
+    pos = _palloc_seek(finfo, (marker & (~PALLOC_MARKER_FLAGS)) + sizeof(marker), SEEK_CUR);
+  }
+  if (pos >= finfo->medium_size) {
+    finfo->first_free = 0;
+  } else {
+    finfo->first_free = pos;
+  }
+}
+
+struct palloc_fd_info * _palloc_attach(PALLOC_FD fd, const struct palloc_backend *backend, void *udata) {
+  struct palloc_fd_info *finfo = calloc(1, sizeof(struct palloc_fd_info));
+  PALLOC_SPAN(span);
+  if (!finfo) return NULL;
+  PALLOC_SPAN_BEGIN(span, PALLOC_TRACE_INIT, fd, 0, 0);
+  finfo->next    = _fd_info;
+  finfo->fd      = fd;
+  finfo->backend = backend;
+  finfo->udata   = udata;
+  _fd_info       = finfo;
+  _palloc_scan(finfo);
+  PALLOC_SPAN_END(span, finfo->first_free, finfo->medium_size);
+  return finfo;
+}
+
+struct palloc_fd_info * _palloc_info(PALLOC_FD fd) {
+
+  // Attempt to fetch cached version
+  struct palloc_fd_info *finfo = _fd_info;
+  while(finfo) {
+    if (finfo->fd == fd) break;
+    finfo = finfo->next;
+  }
+
+  // Build new if no cached version was found
+  // Unknown descriptors are plain os descriptors
+  if (!finfo) {
+    finfo = _palloc_attach(fd, &palloc_backend_os, (void*)(intptr_t)fd);
+  }
+
+  return finfo;
+}
+// }}}
+
+PALLOC_FD palloc_open(const char *filename, PALLOC_FLAGS flags) {
+
+  // Try to fetch the canonical path to the filename
+  char *filepath = canonical_path(filename);
+  if (!filepath) {
+    perror("palloc_open::realpath");
+    return 0;
+  }
+
+  // Prep real open flags
+  int openFlags = O_RDWR | O_CREAT;
+#if defined(__APPLE__) || defined(_WIN32) || defined(_WIN64)
+  // No O_LARGEFILE needed
+#else
+  openFlags |= O_LARGEFILE;
+#endif
+  if (flags & PALLOC_SYNC) {
+    openFlags |= O_DSYNC;
+  }
+
+  // Open the file
+  PALLOC_FD fd = open_os(filepath, openFlags, OPENMODE);
+  if (fd < 0) {
+    perror("palloc_open::open");
+    free(filepath);
+    return 0;
+  }
+
+  // Pre-cache info
+  _palloc_info(fd);
+
+  free(filepath);
+  return fd;
+}
+
+PALLOC_FD palloc_open_backend(const struct palloc_backend *backend, void *udata) {
+  if (!backend) return 0;
+  PALLOC_FD fd = ++_fd_virtual;
+  if (!_palloc_attach(fd, backend, udata)) {
+    perror("palloc_open_backend::calloc");
+    return 0;
+  }
+  return fd;
+}
+
+PALLOC_FD palloc_open_memory() {
+  struct palloc_memory *mem = calloc(1, sizeof(struct palloc_memory));
+  if (!mem) {
+    perror("palloc_open_memory::calloc");
+    return 0;
+  }
+  PALLOC_FD fd = palloc_open_backend(&palloc_backend_memory, mem);
+  if (!fd) free(mem);
+  return fd;
+}
+
+PALLOC_FD palloc_open_memfd(const char *name) {
+#if defined(PALLOC_HAVE_MEMFD)
+  PALLOC_FD fd = memfd_create(name ? name : "palloc", MFD_CLOEXEC);
+  if (fd < 0) {
+    perror("palloc_open_memfd::memfd_create");
+    return 0;
+  }
+  _palloc_info(fd);
+  return fd;
+#else
+  // No memfd on this platform, a process-local buffer is the closest match
+  (void)name;
+  return palloc_open_memory();
+#endif
+}
+
+PALLOC_RESPONSE palloc_close(PALLOC_FD fd) {
+  const struct palloc_backend *backend = &palloc_backend_os;
+  void *udata = (void*)(intptr_t)fd;
+
+  // Free fd info if we have it
+  struct palloc_fd_info *finfo_cur = _fd_info;
+  struct palloc_fd_info *finfo_prv = NULL;
+
+  while(finfo_cur) {
+    if (finfo_cur->fd == fd) break;
+    finfo_prv = finfo_cur;
+    finfo_cur = finfo_cur->next;
+  }
+
+  if (finfo_cur) {
+    // Link whatever frees are still pending
+    // Unlinked ones stay hidden for palloc_repair to link
+    if (!_palloc_lock(finfo_cur, PALLOC_LOCK_WRITE)) {
+      _palloc_flush(finfo_cur);
+      _palloc_unlock(finfo_cur, PALLOC_LOCK_WRITE);
+    }
+    free(finfo_cur->pending);
+    _palloc_record_stop(finfo_cur);
+    _palloc_extent_reset(finfo_cur);
+    _palloc_handles_reset(finfo_cur);
+    // Remember how to close the medium
+    backend = finfo_cur->backend;
+    udata   = finfo_cur->udata;
+    // Point prev to our next
+    if (finfo_prv) finfo_prv->next = finfo_cur->next;
+    else _fd_info = finfo_cur->next;
+    // Free the info
+    free(finfo_cur);
+  }
+
+  const int r = backend->close ? backend->close(udata) : 0;
+  if (r) {
+    perror("close");
+    return PALLOC_ERR;
+  }
+  return PALLOC_OK;
+}
+
+PALLOC_RESPONSE palloc_init(PALLOC_FD fd, PALLOC_FLAGS flags) {
+
+  // Pre-fetch medium info
+  // The medium may have been sized since it was opened
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  finfo->medium_size = _palloc_seek(finfo, 0, SEEK_END);
+
+  // An initialized medium dictates it's own header size
+  const int min_header_size = _palloc_header_size(finfo->header_size ? finfo->flags : flags);
+  const int min_medium_size = min_header_size + (sizeof(PALLOC_SIZE)*2) + (sizeof(PALLOC_OFFSET)*2);
+  char *z = calloc(min_medium_size, 1);
+
+  // Make sure the medium has room for the header
+  if (finfo->medium_size < min_header_size) {
+    if (flags & PALLOC_DYNAMIC) {
+      _palloc_seek(finfo, 0, SEEK_SET);
+      _palloc_write(finfo, z, min_header_size);
+      finfo->medium_size = min_header_size;
+      _palloc_seek(finfo, 0, SEEK_SET);
+    } else {
+      fprintf(stderr, "Incompatible medium\n");
+      free(z);
+      return PALLOC_ERR;
+    }
+  }
+
+  // Fix broken size
+  if ((finfo->medium_size > min_header_size) && (finfo->medium_size < min_medium_size)) {
+    if (flags & PALLOC_DYNAMIC) {
+      _palloc_seek(finfo, min_header_size, SEEK_SET);
+      _palloc_write(finfo, z, min_medium_size - min_header_size);
+      finfo->medium_size = min_medium_size;
+      _palloc_seek(finfo, 0, SEEK_SET);
+    } else {
+      fprintf(stderr, "Incompatible medium\n");
+      free(z);
+      return PALLOC_ERR;
+    }
+  }
+
+  // Actually read the header
+  char *hdr  = malloc(min_header_size);
+  _palloc_seek(finfo, 0, SEEK_SET);
+  if (_palloc_read(finfo, hdr, min_header_size) != min_header_size) {
+    perror("palloc_init::read");
+    free(z);
+    free(hdr);
+    return PALLOC_ERR;
+  }
+
+  // Bail early if already initialized
+  if (memcmp(hdr, expected_header, expected_header_size) == 0) {
+    free(z);
+    free(hdr);
+    return PALLOC_OK;
+  }
+
+  // Build & write new header
+  finfo->flags        = flags;
+  PALLOC_FLAGS nflags = PALLOC_HTOBE_FLAGS(finfo->flags & (~PALLOC_SYNC));
+  memset(hdr, 0, min_header_size);
+  memcpy(hdr, expected_header, expected_header_size);
+  memcpy(hdr + expected_header_size, &nflags, sizeof(PALLOC_FLAGS));
+  _palloc_seek(finfo, 0, SEEK_SET);
+  if (_palloc_write(finfo, hdr, min_header_size) != min_header_size) {
+    perror("palloc_init::write_header");
+    free(z);
+    free(hdr);
+    return PALLOC_ERR;
+  }
+
+  // Keep track of header size
+  if (min_header_size > finfo->header_size) {
+    finfo->header_size = min_header_size;
+  }
+
+  // Mark remainder of medium free
+  if (finfo->medium_size >= min_medium_size) {
+    PALLOC_SIZE   marker = PALLOC_HTOBE_SIZE((PALLOC_SIZE)((finfo->medium_size - min_header_size - (sizeof(PALLOC_SIZE)*2)) | PALLOC_MARKER_FREE));
+    PALLOC_OFFSET ptr    = PALLOC_HTOBE_OFFSET((PALLOC_OFFSET)0);
+    _palloc_seek(finfo, finfo->header_size, SEEK_SET);
+    finfo->first_free = finfo->header_size;
+    if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+      perror("palloc_init::write_marker_start");
+      free(z);
+      free(hdr);
+      return PALLOC_ERR;
+    }
+    if (_palloc_write(finfo, &ptr, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
+      perror("palloc_init::write_ptr_prev");
+      free(z);
+      free(hdr);
+      return PALLOC_ERR;
+    }
+    if (_palloc_write(finfo, &ptr, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
+      perror("palloc_init::write_ptr_next");
+      free(z);
+      free(hdr);
+      return PALLOC_ERR;
+    }
+    _palloc_seek(finfo, 0 - sizeof(PALLOC_SIZE), SEEK_END);
+    if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+      perror("palloc_init::write_marker_end");
+      free(z);
+      free(hdr);
+      return PALLOC_ERR;
+    }
+    _palloc_seal(finfo, finfo->header_size, PALLOC_BETOH_SIZE(marker));
+  }
+  _palloc_extent_reset(finfo);
+  _palloc_handles_reset(finfo);
+
+  // Announce the fresh medium to other processes, on an even generation
+  if (finfo->flags & PALLOC_SHARED) {
+    finfo->generation |= 1;
+    _palloc_publish(finfo);
+  }
+
+  free(z);
+  free(hdr);
+  return PALLOC_OK;
+}
+
+// Blocks up to this size are appended using a single write
+#define PALLOC_APPEND_COMBINED 4096
+
+// Appends an occupied block to the end of the medium, without touching the
+// free list. The data section is left as a hole when not written combined.
+PALLOC_OFFSET _palloc_append(struct palloc_fd_info *finfo, PALLOC_SIZE size) {
+  char          combined[PALLOC_APPEND_COMBINED];
+  PALLOC_SIZE   total  = size + (sizeof(PALLOC_SIZE)*2);
+  PALLOC_SIZE   marker = PALLOC_HTOBE_SIZE(size);
+  PALLOC_OFFSET block  = _palloc_seek(finfo, 0, SEEK_END);
+  uint64_t      tail[2];
+  PALLOC_SIZE   tail_len = 0;
+
+  // Check slot and trailing marker
+  if (finfo->flags & PALLOC_CHECKSUM) {
+    tail[tail_len++] = htobe64(_palloc_check_marker(block, size));
+  }
+  tail[tail_len++] = marker;
+  tail_len *= sizeof(uint64_t);
+
+  if (total <= PALLOC_APPEND_COMBINED) {
+    memset(combined, 0, total);
+    memcpy(combined, &marker, sizeof(marker));
+    memcpy(combined + total - tail_len, tail, tail_len);
+    if (_palloc_write(finfo, combined, total) != total) {
+      perror("palloc::write");
+      return 0;
+    }
+  } else {
+    if (_palloc_write(finfo, &marker, sizeof(marker)) != sizeof(marker)) {
+      perror("palloc::write");
+      return 0;
+    }
+    _palloc_seek(finfo, block + total - tail_len, SEEK_SET);
+    if (_palloc_write(finfo, tail, tail_len) != tail_len) {
+      perror("palloc::write");
+      return 0;
+    }
+  }
+
+  finfo->medium_size = block + total;
+  return block + sizeof(PALLOC_SIZE);
+}
+
+// Allocates from the fitting free block closest to near, where near 0 gives
+// plain first-fit
+PALLOC_OFFSET _palloc_place(struct palloc_fd_info *finfo, PALLOC_SIZE size, PALLOC_OFFSET near) {
+  PALLOC_SIZE marker, selected_size = 0;
+  PALLOC_OFFSET free_prev = 0, free_pprev = 0;
+  PALLOC_OFFSET free_next = 0, free_nnext = 0;
+  PALLOC_SIZE   requested = size;
+  PALLOC_OFFSET selected  = 0;
+  struct palloc_extent *fit, *before;
+
+  // Handle minimum size
+  if (size < (sizeof(PALLOC_OFFSET)*2)) {
+    size = sizeof(PALLOC_OFFSET) * 2;
+  }
+
+  // Make room for the check slot
+  size += _palloc_check_size(finfo);
+
+  // Find the first free block that'll fit
+  _palloc_extent_build(finfo);
+  fit = _palloc_extent_fit_after(finfo->extents, size, near);
+  if (near) {
+    before = _palloc_extent_fit_before(finfo->extents, size, near);
+    if (before && (!fit || ((near - MIN(near, before->offset + before->size + (sizeof(PALLOC_SIZE)*2))) < (fit->offset - near)))) {
+      fit = before;
+    }
+  }
+  if (fit) {
+    selected      = fit->offset;
+    selected_size = fit->size;
+  }
+
+  // Deferred frees may hold the space we need
+  if ((!selected) && finfo->pending_len) {
+    _palloc_flush(finfo);
+    return _palloc_place(finfo, requested, near);
+  }
+
+  // Handle full(-ish) medium when not dynamic
+  if ((!selected) && (!(finfo->flags & PALLOC_DYNAMIC))) {
+    return 0;
+  }
+
+  // Allocate new space at the end if dynamic and needed
+  if (!selected) {
+    return _palloc_append(finfo, size);
+  }
+
+  // Split block if large enough
+  // marker,free_next,free_prev & fd position are dirty after this
+  if ((selected_size - size) > ((sizeof(PALLOC_SIZE)*2)+(sizeof(PALLOC_OFFSET)*2)+_palloc_check_size(finfo))) {
+    marker    = PALLOC_HTOBE_SIZE(size | PALLOC_MARKER_FREE);
+    free_next = PALLOC_HTOBE_OFFSET(selected + size + (sizeof(PALLOC_SIZE)*2));
+    free_prev = PALLOC_HTOBE_OFFSET(selected);
+    // Update selected block
+    _palloc_seek(finfo, selected, SEEK_SET);
+    if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+      perror("palloc::write");
+      return 0;
+    }
+    _palloc_seek(finfo, sizeof(PALLOC_OFFSET), SEEK_CUR);
+    _palloc_read(finfo, &free_nnext, sizeof(PALLOC_OFFSET));
+    _palloc_seek(finfo, 0 - sizeof(PALLOC_OFFSET), SEEK_CUR);
+    if (_palloc_write(finfo, &free_next, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
+      perror("palloc::write");
+      return 0;
+    }
+    _palloc_seek(finfo, size - (sizeof(PALLOC_OFFSET)*2), SEEK_CUR);
+    if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+      perror("palloc::write");
+      return 0;
+    }
+    // Initialize new free block
+    marker = PALLOC_HTOBE_SIZE((selected_size - size - (sizeof(PALLOC_SIZE)*2)) | PALLOC_MARKER_FREE);
+    free_pprev = PALLOC_HTOBE_OFFSET(_palloc_seek(finfo, 0, SEEK_CUR));
+    if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+      perror("palloc::write");
+      return 0;
+    }
+    if (_palloc_write(finfo, &free_prev, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
+      perror("palloc::write");
       return 0;
     }
-    // Initialize new free block
-    marker = PALLOC_HTOBE_SIZE((selected_size - size - (sizeof(PALLOC_SIZE)*2)) | PALLOC_MARKER_FREE);
-    free_pprev = PALLOC_HTOBE_OFFSET(seek_os(fd, 0, SEEK_CUR));
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc::write");
-      return 0;
+    if (_palloc_write(finfo, &free_nnext, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
+      perror("palloc::write");
+      return 0;
+    }
+    _palloc_seek(finfo, (PALLOC_BETOH_SIZE(marker) & (~PALLOC_MARKER_FLAGS)) - (sizeof(PALLOC_OFFSET)*2), SEEK_CUR);
+    if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+      perror("palloc::write");
+      return 0;
+    }
+    _palloc_seal(finfo, PALLOC_BETOH_OFFSET(free_pprev), PALLOC_BETOH_SIZE(marker));
+    _palloc_extent_insert(finfo, PALLOC_BETOH_OFFSET(free_pprev), PALLOC_BETOH_SIZE(marker) & (~PALLOC_MARKER_FLAGS));
+    // Update next block's pointer
+    free_nnext = PALLOC_BETOH_OFFSET(free_nnext);
+    if (free_nnext) {
+      _palloc_seek(finfo, free_nnext + sizeof(PALLOC_SIZE), SEEK_SET);
+      if (_palloc_write(finfo, &free_pprev, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
+        perror("palloc::write");
+        return 0;
+      }
+    }
+  }
+
+  // Size is now block size, not given size
+  size = _palloc_size(finfo, selected);
+
+  // Remove selected free block from the doubly-linked-list
+  _palloc_seek(finfo, selected + sizeof(PALLOC_SIZE), SEEK_SET);
+  _palloc_read(finfo, &free_prev, sizeof(PALLOC_OFFSET));
+  _palloc_read(finfo, &free_next, sizeof(PALLOC_OFFSET));
+  free_prev = PALLOC_BETOH_OFFSET(free_prev);
+  free_next = PALLOC_BETOH_OFFSET(free_next);
+  if (free_prev) {
+    free_next = PALLOC_HTOBE_OFFSET(free_next);
+    _palloc_seek(finfo, free_prev + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
+    _palloc_write(finfo, &free_next, sizeof(PALLOC_OFFSET));
+    free_next = PALLOC_BETOH_OFFSET(free_next);
+  }
+  if (free_next) {
+    free_prev = PALLOC_HTOBE_OFFSET(free_prev);
+    _palloc_seek(finfo, free_next + sizeof(PALLOC_SIZE), SEEK_SET);
+    _palloc_write(finfo, &free_prev, sizeof(PALLOC_OFFSET));
+    free_prev = PALLOC_BETOH_OFFSET(free_prev);
+  }
+
+  // Fix first free
+  if (finfo->first_free == selected) {
+    finfo->first_free = free_next;
+  }
+  _palloc_extent_remove(finfo, selected);
+
+  // Mark selected block as non-free
+  marker = PALLOC_HTOBE_SIZE(size);
+  _palloc_seek(finfo, selected, SEEK_SET);
+  if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+    perror("palloc::write");
+    return 0;
+  }
+  _palloc_seek(finfo, size, SEEK_CUR);
+  if (_palloc_write(finfo, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+    perror("palloc::write");
+    return 0;
+  }
+  _palloc_seal(finfo, selected, size);
+
+  // And return the pointer to the start of the data
+  return selected + sizeof(PALLOC_SIZE);
+}
+
+// Every allocation passes here or appends itself, to be recorded
+PALLOC_OFFSET _palloc_near(struct palloc_fd_info *finfo, PALLOC_SIZE size, PALLOC_OFFSET near) {
+  PALLOC_OFFSET result = _palloc_place(finfo, size, near);
+  if (result) _palloc_record(finfo, PALLOC_RECORD_ALLOC, size, result);
+  return result;
+}
+
+PALLOC_OFFSET _palloc(struct palloc_fd_info *finfo, PALLOC_SIZE size) {
+  return _palloc_near(finfo, size, 0);
+}
+
+int _pfree_merge(struct palloc_fd_info *finfo, PALLOC_OFFSET left, PALLOC_OFFSET right) {
+  PALLOC_SIZE left_marker  = _palloc_marker(finfo, left );
+  PALLOC_SIZE right_marker = _palloc_marker(finfo, right);
+  PALLOC_SIZE left_size    = left_marker  & (~PALLOC_MARKER_FLAGS);
+  PALLOC_SIZE right_size   = right_marker & (~PALLOC_MARKER_FLAGS);
+  PALLOC_OFFSET right_next;
+  PALLOC_SPAN(span);
+  PALLOC_SPAN_BEGIN(span, PALLOC_TRACE_MERGE, finfo->fd, left, right);
+
+  // Not both free = do not merge
+  if (!(left_marker & right_marker & PALLOC_MARKER_FREE)) {
+    PALLOC_SPAN_END(span, left, 0);
+    return 0;
+  }
+
+  // Not consecutive = do not merge
+  if ((left + left_size + (sizeof(PALLOC_SIZE)*2)) != right) {
+    PALLOC_SPAN_END(span, left, 0);
+    return 0;
+  }
+
+  // Read the right_next, as that'll become our next
+  _palloc_seek(finfo, right + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
+  _palloc_read(finfo, &right_next, sizeof(PALLOC_OFFSET));
+
+  // Actually merge the blocks into 1 big one
+  left_size   = left_size + right_size + (sizeof(PALLOC_SIZE)*2);
+  left_marker = PALLOC_HTOBE_SIZE(left_size | PALLOC_MARKER_FREE);
+  _palloc_seek(finfo, left, SEEK_SET);
+  _palloc_write(finfo, &left_marker, sizeof(left_marker));
+  _palloc_seek(finfo, sizeof(PALLOC_OFFSET), SEEK_CUR);
+  _palloc_write(finfo, &right_next, sizeof(right_next));
+  _palloc_seek(finfo, left_size - (sizeof(PALLOC_OFFSET)*2), SEEK_CUR);
+  _palloc_write(finfo, &left_marker, sizeof(left_marker));
+  _palloc_seal(finfo, left, left_size | PALLOC_MARKER_FREE);
+  _palloc_extent_remove(finfo, right);
+  _palloc_extent_resize(finfo->extents, left, left_size);
+
+  // Update right_next's prev pointer
+  if (PALLOC_BETOH_OFFSET(right_next)) {
+    left = PALLOC_HTOBE_OFFSET(left);
+    _palloc_seek(finfo, PALLOC_BETOH_OFFSET(right_next) + sizeof(PALLOC_SIZE), SEEK_SET);
+    _palloc_write(finfo, &left, sizeof(left));
+    left = PALLOC_BETOH_OFFSET(left);
+  }
+
+  PALLOC_SPAN_END(span, left, left_size);
+  return 1;
+}
+
+// Marks a block pending without linking it, queueing it for _palloc_flush
+// The free list pointers are cleared so the block is never followed, and the
+// pending marker keeps a re-opening scan from taking it as the first free
+PALLOC_RESPONSE _pfree_defer(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr, PALLOC_SIZE marker) {
+  PALLOC_OFFSET *grown;
+  uint64_t      buf[3] = { PALLOC_HTOBE_SIZE(marker | PALLOC_MARKER_PENDING), 0, 0 };
+
+  if (finfo->pending_len == finfo->pending_cap) {
+    finfo->pending_cap = finfo->pending_cap ? (finfo->pending_cap * 2) : 64;
+    grown = realloc(finfo->pending, finfo->pending_cap * sizeof(PALLOC_OFFSET));
+    if (!grown) {
+      perror("pfree::realloc");
+      return PALLOC_ERR;
+    }
+    finfo->pending = grown;
+  }
+
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  if (_palloc_write(finfo, buf, sizeof(buf)) != sizeof(buf)) {
+    perror("pfree::write");
+    return PALLOC_ERR;
+  }
+  _palloc_seek(finfo, ptr + sizeof(PALLOC_SIZE) + marker, SEEK_SET);
+  if (_palloc_write(finfo, buf, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+    perror("pfree::write");
+    return PALLOC_ERR;
+  }
+  _palloc_seal(finfo, ptr, marker | PALLOC_MARKER_PENDING);
+
+  finfo->pending[finfo->pending_len++] = ptr;
+  return PALLOC_OK;
+}
+
+int _palloc_offset_cmp(const void *a, const void *b) {
+  PALLOC_OFFSET l = *((const PALLOC_OFFSET *)a);
+  PALLOC_OFFSET r = *((const PALLOC_OFFSET *)b);
+  return (l > r) - (l < r);
+}
+
+// Links all deferred frees in ascending order, so merges chain up
+void _palloc_flush(struct palloc_fd_info *finfo) {
+  PALLOC_OFFSET ptr;
+  PALLOC_SIZE   i;
+
+  if (!finfo->pending_len) return;
+  qsort(finfo->pending, finfo->pending_len, sizeof(PALLOC_OFFSET), _palloc_offset_cmp);
+  _palloc_extent_build(finfo);
+
+  for(i = 0; i < finfo->pending_len; i++) {
+    ptr = finfo->pending[i];
+    _pfree_link(finfo, ptr,
+      _palloc_extent_prev(finfo->extents, ptr),
+      _palloc_extent_next(finfo->extents, ptr)
+    );
+  }
+
+  finfo->pending_len = 0;
+}
+
+// Links a block into the free list between the given neighbours, merging
+// and truncating where possible. Returns the free block now covering ptr, or
+// the free block before it if it was truncated away.
+PALLOC_OFFSET _pfree_link(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr, PALLOC_OFFSET free_prev, PALLOC_OFFSET free_next) {
+  PALLOC_SIZE marker, size;
+  PALLOC_OFFSET off_left, off_right;
+
+  // We need BE pointers during the next block
+  free_prev = PALLOC_HTOBE_OFFSET(free_prev);
+  free_next = PALLOC_HTOBE_OFFSET(free_next);
+
+  // Mark ourselves as free & link into free list
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  _palloc_read(finfo, &marker, sizeof(PALLOC_SIZE));
+  size   = PALLOC_BETOH_SIZE(marker) & (~PALLOC_MARKER_FLAGS);
+  marker = PALLOC_HTOBE_SIZE(size | PALLOC_MARKER_FREE);
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  _palloc_write(finfo, &marker, sizeof(marker));
+  _palloc_write(finfo, &free_prev, sizeof(free_prev));
+  _palloc_write(finfo, &free_next, sizeof(free_next));
+  _palloc_seek(finfo, size - (sizeof(PALLOC_SIZE)*2), SEEK_CUR);
+  _palloc_write(finfo, &marker, sizeof(marker));
+  _palloc_seal(finfo, ptr, size | PALLOC_MARKER_FREE);
+  _palloc_extent_insert(finfo, ptr, size);
+
+  // Update first_free if needed
+  if ((!(finfo->first_free)) || (finfo->first_free > ptr)) {
+    finfo->first_free = ptr;
+  }
+
+  // We need H pointers during the next block
+  free_prev = PALLOC_BETOH_OFFSET(free_prev);
+  free_next = PALLOC_BETOH_OFFSET(free_next);
+
+  // Update our neighbours' pointers
+  if (free_prev) {
+    _palloc_seek(finfo, free_prev + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
+    off_left = PALLOC_HTOBE_OFFSET(ptr);
+    _palloc_write(finfo, &off_left, sizeof(PALLOC_SIZE));
+  }
+  if (free_next) {
+    _palloc_seek(finfo, free_next + sizeof(PALLOC_SIZE), SEEK_SET);
+    off_right = PALLOC_HTOBE_OFFSET(ptr);
+    _palloc_write(finfo, &off_right, sizeof(PALLOC_SIZE));
+  }
+
+  // Merge with neighbours if consecutive
+  // Next first, so we don't need to update our tracking
+  if (free_next) { _pfree_merge(finfo, ptr, free_next); }
+  if (free_prev && _pfree_merge(finfo, free_prev, ptr)) { ptr = free_prev; }
+
+  // Truncate if last in file
+  size = _palloc_size(finfo, ptr);
+  if (finfo->flags & PALLOC_DYNAMIC) {
+    if (ptr + size + (sizeof(PALLOC_SIZE)*2) >= finfo->medium_size) {
+
+      // Remove free_prev's next pointer
+      _palloc_seek(finfo, ptr + sizeof(PALLOC_SIZE), SEEK_SET);
+      _palloc_read(finfo, &free_prev, sizeof(free_prev));
+      free_prev = PALLOC_BETOH_OFFSET(free_prev);
+      if (free_prev) {
+        free_next = PALLOC_HTOBE_OFFSET(0);
+        _palloc_seek(finfo, free_prev + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
+        _palloc_write(finfo, &free_next, sizeof(free_next));
+      }
+
+      // Truncate the file
+      if (finfo->first_free == ptr) {
+        finfo->first_free = 0;
+      }
+      _palloc_extent_remove(finfo, ptr);
+      _palloc_truncate(finfo, ptr);
+      finfo->medium_size = ptr;
+      return free_prev;
+    }
+  }
+
+  return ptr;
+}
+
+PALLOC_RESPONSE _pfree(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr) {
+  PALLOC_SIZE   marker, size, count, i;
+  PALLOC_OFFSET *list;
+
+  // Convert pointer to outer
+  ptr -= sizeof(PALLOC_SIZE);
+
+  // Get the pointer's own marker in advance
+  // Bail early if already free
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  _palloc_read(finfo, &marker, sizeof(PALLOC_SIZE));
+  marker = PALLOC_BETOH_SIZE(marker);
+  if (marker & PALLOC_MARKER_FREE) {
+    return PALLOC_OK;
+  }
+
+  // Chain heads take their extents along
+  if (marker & PALLOC_MARKER_CHAIN) {
+    list = _palloc_chain_load(finfo, ptr + sizeof(PALLOC_SIZE), &size, &count);
+    if (!list) return PALLOC_ERR;
+    for(i = 0; i < count; i++) {
+      _pfree(finfo, list[i*2]);
+    }
+    free(list);
+  }
+  marker &= ~PALLOC_MARKER_FLAGS;
+  _palloc_record(finfo, PALLOC_RECORD_FREE, 0, ptr + sizeof(PALLOC_SIZE));
+
+  // Deferred mode only marks the block free, linking happens on flush
+  if (finfo->defer) {
+    return _pfree_defer(finfo, ptr, marker);
+  }
+
+  // Detect free neighbours
+  _palloc_extent_build(finfo);
+  _pfree_link(finfo, ptr,
+    _palloc_extent_prev(finfo->extents, ptr),
+    _palloc_extent_next(finfo->extents, ptr)
+  );
+  return PALLOC_OK;
+}
+
+PALLOC_OFFSET palloc(PALLOC_FD fd, PALLOC_SIZE size) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_SPAN(span);
+  PALLOC_SPAN_BEGIN(span, PALLOC_TRACE_PALLOC, fd, 0, size);
+  PALLOC_OFFSET result = 0;
+  if (!_palloc_lock(finfo, PALLOC_LOCK_WRITE)) {
+    result = _palloc(finfo, size);
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  }
+  PALLOC_SPAN_END(span, result, size);
+  return result;
+}
+
+PALLOC_OFFSET palloc_hint(PALLOC_FD fd, PALLOC_SIZE size, PALLOC_OFFSET near) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return 0;
+  PALLOC_OFFSET result = _palloc_near(finfo, size, near);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return result;
+}
+
+PALLOC_RESPONSE palloc_available(PALLOC_FD fd, struct palloc_stats *stats) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_SIZE check, size, i;
+
+  memset(stats, 0, sizeof(*stats));
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return PALLOC_ERR;
+  _palloc_extent_build(finfo);
+  check = _palloc_check_size(finfo);
+  if (finfo->extents) {
+    stats->blocks  = finfo->extents->count;
+    stats->free    = finfo->extents->total - (stats->blocks * check);
+    stats->largest = finfo->extents->max - check;
+  }
+
+  // Deferred frees count as free, as palloc would flush & use them
+  for(i = 0; i < finfo->pending_len; i++) {
+    size = (_palloc_marker(finfo, finfo->pending[i]) & (~PALLOC_MARKER_FLAGS)) - check;
+    stats->blocks++;
+    stats->free   += size;
+    stats->largest = MAX(stats->largest, size);
+  }
+
+  if (stats->free) {
+    stats->fragmentation = 1.0 - (((double)stats->largest) / stats->free);
+  }
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return finfo->extents_valid ? PALLOC_OK : PALLOC_ERR;
+}
+
+// Appends a free block to the end of a dynamic medium, merging it with a
+// free block right before it
+PALLOC_RESPONSE _palloc_grow(struct palloc_fd_info *finfo, PALLOC_SIZE size) {
+  struct palloc_extent *last = _palloc_extent_last(finfo->extents);
+  PALLOC_OFFSET block = _palloc_seek(finfo, 0, SEEK_END);
+  PALLOC_OFFSET prev  = last ? last->offset : 0;
+  uint64_t      buf[3] = {
+    PALLOC_HTOBE_SIZE(size | PALLOC_MARKER_FREE),
+    PALLOC_HTOBE_OFFSET(prev),
+    0,
+  };
+
+  _palloc_seek(finfo, block, SEEK_SET);
+  if (_palloc_write(finfo, buf, sizeof(buf)) != sizeof(buf)) {
+    perror("palloc_reserve::write");
+    return PALLOC_ERR;
+  }
+  _palloc_seek(finfo, block + sizeof(PALLOC_SIZE) + size, SEEK_SET);
+  if (_palloc_write(finfo, buf, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
+    perror("palloc_reserve::write");
+    return PALLOC_ERR;
+  }
+  finfo->medium_size = block + size + (sizeof(PALLOC_SIZE)*2);
+  _palloc_seal(finfo, block, size | PALLOC_MARKER_FREE);
+
+  // Link as the last free block
+  if (prev) {
+    buf[0] = PALLOC_HTOBE_OFFSET(block);
+    _palloc_seek(finfo, prev + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
+    _palloc_write(finfo, buf, sizeof(PALLOC_OFFSET));
+  } else {
+    finfo->first_free = block;
+  }
+  _palloc_extent_insert(finfo, block, size);
+  if (prev) _pfree_merge(finfo, prev, block);
+  return PALLOC_OK;
+}
+
+PALLOC_RESPONSE palloc_reserve(PALLOC_FD fd, PALLOC_SIZE size) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_extent *last;
+  PALLOC_RESPONSE result = PALLOC_OK;
+  PALLOC_SIZE   needed, tail = 0;
+
+  // A single free block must hold the whole batch, including it's check slot
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  _palloc_flush(finfo);
+  _palloc_extent_build(finfo);
+  needed = size + _palloc_check_size(finfo);
+  if (!finfo->extents_valid) {
+    result = PALLOC_ERR;
+  } else if (!finfo->extents || (finfo->extents->max < needed)) {
+    if (!(finfo->flags & PALLOC_DYNAMIC)) {
+      result = PALLOC_ERR;
+    } else {
+
+      // Grow the trailing free block, or start a new one
+      last = _palloc_extent_last(finfo->extents);
+      if (last && ((last->offset + last->size + (sizeof(PALLOC_SIZE)*2)) == finfo->medium_size)) {
+        tail = last->size + (sizeof(PALLOC_SIZE)*2);
+      }
+      needed = MAX(needed, (sizeof(PALLOC_OFFSET)*2) + _palloc_check_size(finfo) + tail);
+      result = _palloc_grow(finfo, needed - tail);
+    }
+  }
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return result;
+}
+
+PALLOC_RESPONSE pfree(PALLOC_FD fd, PALLOC_OFFSET ptr) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_SPAN(span);
+  PALLOC_SPAN_BEGIN(span, PALLOC_TRACE_PFREE, fd, ptr, 0);
+  PALLOC_RESPONSE result = PALLOC_ERR;
+  if (!_palloc_lock(finfo, PALLOC_LOCK_WRITE)) {
+    result = _pfree(finfo, ptr);
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  }
+  PALLOC_SPAN_END(span, ptr, 0);
+  return result;
+}
+
+PALLOC_RESPONSE palloc_defer(PALLOC_FD fd, int enabled) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  finfo->defer = enabled;
+  if (!enabled) _palloc_flush(finfo);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return PALLOC_OK;
+}
+
+PALLOC_RESPONSE palloc_flush(PALLOC_FD fd) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  _palloc_flush(finfo);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return PALLOC_OK;
+}
+
+// Compressed blobs start with their logical and compressed size
+#define PALLOC_COMPRESS_HEADER (sizeof(PALLOC_SIZE)*2)
+
+// Logical size of a blob's data, which palloc_load returns
+PALLOC_SIZE _palloc_data_size(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr) {
+  PALLOC_SIZE marker = _palloc_marker(finfo, ptr - sizeof(PALLOC_SIZE));
+  PALLOC_SIZE size;
+  if (!(marker & PALLOC_MARKER_COMPRESSED)) {
+    return (marker & (~PALLOC_MARKER_FLAGS)) - _palloc_check_size(finfo);
+  }
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  if (_palloc_read(finfo, &size, sizeof(size)) != sizeof(size)) return 0;
+  return PALLOC_BETOH_SIZE(size);
+}
+
+PALLOC_SIZE palloc_size(PALLOC_FD fd, PALLOC_OFFSET ptr) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return 0;
+  PALLOC_SIZE result = _palloc_size(finfo, ptr - sizeof(PALLOC_SIZE)) - _palloc_check_size(finfo);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return result;
+}
+
+int64_t palloc_read(PALLOC_FD fd, PALLOC_OFFSET ptr, void *buf, PALLOC_SIZE count) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_seek(finfo, ptr, SEEK_SET) < 0) return -1;
+  return _palloc_read(finfo, buf, count);
+}
+
+int64_t palloc_write(PALLOC_FD fd, PALLOC_OFFSET ptr, const void *buf, PALLOC_SIZE count) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_seek(finfo, ptr, SEEK_SET) < 0) return -1;
+  return _palloc_write(finfo, buf, count);
+}
+
+// Iterates forward, giving up once a block starts at or beyond limit
+PALLOC_OFFSET _palloc_next(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr, PALLOC_OFFSET limit) {
+  PALLOC_SIZE marker;
+
+  // Easy resolve
+  limit = MIN(limit, finfo->medium_size);
+  if (ptr >= limit) return 0;
+
+  // Handle first
+  if (!ptr) {
+    ptr = finfo->header_size;
+    if (ptr >= limit) return 0;
+    _palloc_seek(finfo, ptr, SEEK_SET);
+    if (_palloc_read(finfo, &marker, sizeof(marker)) != sizeof(marker)) return 0;
+    marker = PALLOC_BETOH_SIZE(marker);
+    if (!_palloc_intact(finfo, ptr, marker)) return 0;
+    if (!(marker & PALLOC_MARKER_HIDDEN)) return ptr + sizeof(marker);
+
+  // Convert pointer to internal usage
+  } else {
+    ptr -= sizeof(PALLOC_SIZE);
+  }
+
+  // Read the marker of the given block
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  if (_palloc_read(finfo, &marker, sizeof(marker)) != sizeof(marker)) return 0;
+  marker = PALLOC_BETOH_SIZE(marker);
+  if (!_palloc_intact(finfo, ptr, marker)) return 0;
+
+  // Skip the first one
+  ptr = ptr + (sizeof(PALLOC_SIZE) * 2) + (marker & (~PALLOC_MARKER_FLAGS));
+  while(1) {
+    if (ptr >= limit) return 0;
+    PALLOC_VISIT();
+    _palloc_seek(finfo, ptr, SEEK_SET);
+    if (_palloc_read(finfo, &marker, sizeof(marker)) != sizeof(marker)) return 0;
+    marker = PALLOC_BETOH_SIZE(marker);
+    if (!_palloc_intact(finfo, ptr, marker)) return 0;
+    if (!(marker & PALLOC_MARKER_HIDDEN)) return ptr + sizeof(marker);
+    ptr += (sizeof(marker)*2) + (marker & (~PALLOC_MARKER_FLAGS));
+  }
+
+  return 0;
+}
+
+PALLOC_RESPONSE palloc_seal(PALLOC_FD fd, PALLOC_OFFSET ptr) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_stream stream = { .finfo = finfo, .capacity = PALLOC_STREAM_SIZE };
+  PALLOC_OFFSET block = ptr - sizeof(PALLOC_SIZE);
+  PALLOC_SIZE   marker, size, chunk;
+  const char    *data;
+  uint32_t      crc = 0;
+  uint64_t      check;
+
+  if (!(finfo->flags & PALLOC_CHECKSUM)) return PALLOC_ERR;
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  marker = _palloc_marker(finfo, block);
+  if ((marker & PALLOC_MARKER_HIDDEN) || !_palloc_intact(finfo, block, marker)) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_ERR;
+  }
+
+  // Checksum the data section, excluding the check slot itself
+  stream.buf = malloc(stream.capacity);
+  size       = (marker & (~PALLOC_MARKER_FLAGS)) - sizeof(check);
+  while(size) {
+    chunk = MIN(size, stream.capacity);
+    data  = _palloc_stream_peek(&stream, ptr, chunk);
+    if (!data) break;
+    crc   = _palloc_crc32c(crc, data, chunk);
+    ptr  += chunk;
+    size -= chunk;
+  }
+  free(stream.buf);
+  if (size) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_ERR;
+  }
+
+  check = htobe64((((uint64_t)_palloc_check_payload(crc)) << 32) | _palloc_check_marker(block, marker));
+  _palloc_seek(finfo, block + (marker & (~PALLOC_MARKER_FLAGS)), SEEK_SET);
+  if (_palloc_write(finfo, &check, sizeof(check)) != sizeof(check)) {
+    perror("palloc_seal::write");
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_ERR;
+  }
+
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return PALLOC_OK;
+}
+
+PALLOC_SIZE palloc_verify(PALLOC_FD fd, void (*bad)(PALLOC_FD fd, PALLOC_OFFSET start, PALLOC_OFFSET end, void *udata), void *udata) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_stream stream = { .finfo = finfo, .capacity = PALLOC_STREAM_SIZE };
+  PALLOC_SIZE   marker, trailer, size, remaining, chunk, found = 0;
+  PALLOC_OFFSET pos, data_pos;
+  const char    *data;
+  uint64_t      check;
+  uint32_t      crc;
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return 0;
+  if (!finfo->header_size) {
+    _palloc_unlock(finfo, PALLOC_LOCK_READ);
+    return 0;
+  }
+  stream.buf = malloc(stream.capacity);
+
+  pos = finfo->header_size;
+  while(pos < finfo->medium_size) {
+
+    // Both markers must agree, or we have no way to find the next block
+    data = _palloc_stream_peek(&stream, pos, sizeof(marker));
+    if (!data) break;
+    memcpy(&marker, data, sizeof(marker));
+    marker = PALLOC_BETOH_SIZE(marker);
+    size   = marker & (~PALLOC_MARKER_FLAGS);
+    if (
+      (size < ((sizeof(PALLOC_OFFSET)*2) + _palloc_check_size(finfo))) ||
+      (size > finfo->medium_size) ||
+      ((pos + size + (sizeof(PALLOC_SIZE)*2)) > finfo->medium_size)
+    ) break;
+    data = _palloc_stream_peek(&stream, pos + size, sizeof(check) + sizeof(trailer));
+    if (!data) break;
+    memcpy(&check  , data                , sizeof(check));
+    memcpy(&trailer, data + sizeof(check), sizeof(trailer));
+    if (PALLOC_BETOH_SIZE(trailer) != marker) break;
+
+    // Without checksums, the marker pair is all we can verify
+    if (!(finfo->flags & PALLOC_CHECKSUM)) {
+      pos += size + (sizeof(PALLOC_SIZE)*2);
+      continue;
     }
-    if (write_os(fd, &free_prev, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
-      perror("palloc::write");
-      return 0;
+
+    // Mismatching checksums only taint the block itself
+    check = be64toh(check);
+    if ((check & 0xFFFFFFFF) != _palloc_check_marker(pos, marker)) {
+      found++;
+      if (bad) bad(fd, pos, pos + size + (sizeof(PALLOC_SIZE)*2), udata);
+      pos += size + (sizeof(PALLOC_SIZE)*2);
+      continue;
+    }
+
+    // Sealed blobs get their data verified as well
+    if ((check >> 32) && !(marker & PALLOC_MARKER_FREE)) {
+      crc       = 0;
+      data_pos  = pos + sizeof(PALLOC_SIZE);
+      remaining = size - sizeof(check);
+      while(remaining) {
+        chunk = MIN(remaining, stream.capacity);
+        data  = _palloc_stream_peek(&stream, data_pos, chunk);
+        if (!data) break;
+        crc        = _palloc_crc32c(crc, data, chunk);
+        data_pos  += chunk;
+        remaining -= chunk;
+      }
+      if (remaining || ((check >> 32) != _palloc_check_payload(crc))) {
+        found++;
+        if (bad) bad(fd, pos, pos + size + (sizeof(PALLOC_SIZE)*2), udata);
+      }
+    }
+
+    pos += size + (sizeof(PALLOC_SIZE)*2);
+  }
+
+  // Everything from a broken marker onwards is unreachable
+  if (pos < finfo->medium_size) {
+    found++;
+    if (bad) bad(fd, pos, finfo->medium_size, udata);
+  }
+
+  free(stream.buf);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return found;
+}
+
+// A block which markers (and free list pointers) get rewritten by repair
+struct palloc_repair_entry {
+  PALLOC_OFFSET block;
+  PALLOC_SIZE   marker;
+};
+
+int _palloc_repair_push(struct palloc_repair_entry **list, PALLOC_SIZE *length, PALLOC_SIZE *capacity, PALLOC_OFFSET block, PALLOC_SIZE marker) {
+  struct palloc_repair_entry *grown;
+  if (*length == *capacity) {
+    *capacity = *capacity ? (*capacity * 2) : 64;
+    grown     = realloc(*list, *capacity * sizeof(struct palloc_repair_entry));
+    if (!grown) return -1;
+    *list = grown;
+  }
+  (*list)[*length].block  = block;
+  (*list)[*length].marker = marker;
+  (*length)++;
+  return 0;
+}
+
+int _palloc_repair_write(struct palloc_fd_info *finfo, struct palloc_repair_entry *entry, PALLOC_OFFSET prev, PALLOC_OFFSET next) {
+  PALLOC_SIZE size = entry->marker & (~PALLOC_MARKER_FLAGS);
+  PALLOC_SIZE head = sizeof(PALLOC_SIZE);
+  PALLOC_SIZE tail = 0;
+  uint64_t buf[3];
+
+  // Leading marker, with free list pointers for free blocks
+  buf[0] = PALLOC_HTOBE_SIZE(entry->marker);
+  if (entry->marker & PALLOC_MARKER_FREE) {
+    buf[1] = PALLOC_HTOBE_OFFSET(prev);
+    buf[2] = PALLOC_HTOBE_OFFSET(next);
+    head  += sizeof(PALLOC_OFFSET) * 2;
+  }
+  _palloc_seek(finfo, entry->block, SEEK_SET);
+  if (_palloc_write(finfo, buf, head) != head) return -1;
+
+  // Check slot and trailing marker
+  if (finfo->flags & PALLOC_CHECKSUM) {
+    buf[tail++] = htobe64(_palloc_check_marker(entry->block, entry->marker));
+  }
+  buf[tail++] = PALLOC_HTOBE_SIZE(entry->marker);
+  _palloc_seek(finfo, entry->block + size + sizeof(PALLOC_SIZE) - _palloc_check_size(finfo), SEEK_SET);
+  if (_palloc_write(finfo, buf, tail * sizeof(uint64_t)) != (tail * sizeof(uint64_t))) return -1;
+
+  return 0;
+}
+
+PALLOC_RESPONSE palloc_repair(PALLOC_FD fd) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_stream stream = { .finfo = finfo, .capacity = PALLOC_STREAM_SIZE };
+  struct palloc_repair_entry *runs    = NULL, *reseal    = NULL;
+  PALLOC_SIZE                runs_len = 0   , reseal_len = 0;
+  PALLOC_SIZE                runs_cap = 0   , reseal_cap = 0;
+  PALLOC_SIZE   marker, trailer, size, i, j;
+  PALLOC_OFFSET pos, run_start = 0, run_end = 0, last = 0, end;
+  PALLOC_SIZE   last_marker = 0;
+  const PALLOC_SIZE min_size = (sizeof(PALLOC_OFFSET)*2) + _palloc_check_size(finfo);
+  const char    *data;
+  uint64_t      check;
+  int           err = 0;
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  if (!finfo->header_size) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_ERR;
+  }
+  finfo->medium_size = _palloc_seek(finfo, 0, SEEK_END);
+  stream.buf = malloc(stream.capacity);
+
+  // Single streaming pass, collecting coalesced free runs and occupied
+  // blocks of which the checksum needs to be rewritten
+  pos = finfo->header_size;
+  while(pos < finfo->medium_size) {
+    data = _palloc_stream_peek(&stream, pos, sizeof(marker));
+    if (!data) break;
+    memcpy(&marker, data, sizeof(marker));
+    marker = PALLOC_BETOH_SIZE(marker);
+    size   = marker & (~PALLOC_MARKER_FLAGS);
+    if ((size < min_size) || (size > finfo->medium_size) || ((pos + size + (sizeof(PALLOC_SIZE)*2)) > finfo->medium_size)) break;
+    data = _palloc_stream_peek(&stream, pos + size, sizeof(check) + sizeof(trailer));
+    if (!data) break;
+    memcpy(&check  , data                , sizeof(check));
+    memcpy(&trailer, data + sizeof(check), sizeof(trailer));
+    if (PALLOC_BETOH_SIZE(trailer) != marker) break;
+    end = pos + size + (sizeof(PALLOC_SIZE)*2);
+
+    if (marker & PALLOC_MARKER_FREE) {
+      if (!run_end || (run_end != pos)) {
+        if (run_end) err |= _palloc_repair_push(&runs, &runs_len, &runs_cap, run_start, (run_end - run_start - (sizeof(PALLOC_SIZE)*2)) | PALLOC_MARKER_FREE);
+        run_start = pos;
+      }
+      run_end = end;
+    } else if ((finfo->flags & PALLOC_CHECKSUM) && ((be64toh(check) & 0xFFFFFFFF) != _palloc_check_marker(pos, marker))) {
+      err |= _palloc_repair_push(&reseal, &reseal_len, &reseal_cap, pos, marker);
+    }
+
+    last        = pos;
+    last_marker = marker;
+    pos         = end;
+  }
+  free(stream.buf);
+
+  // Whatever follows a broken marker can no longer be reached
+  if (pos < finfo->medium_size) {
+    fprintf(stderr, "palloc_repair: dropping unreachable %llu bytes at %llu\n", (unsigned long long)(finfo->medium_size - pos), (unsigned long long)pos);
+    if (finfo->flags & PALLOC_DYNAMIC) {
+      _palloc_truncate(finfo, pos);
+      finfo->medium_size = pos;
+    } else if (run_end && (run_end == pos)) {
+      run_end = finfo->medium_size;
+    } else if ((finfo->medium_size - pos) >= (min_size + (sizeof(PALLOC_SIZE)*2))) {
+      if (run_end) err |= _palloc_repair_push(&runs, &runs_len, &runs_cap, run_start, (run_end - run_start - (sizeof(PALLOC_SIZE)*2)) | PALLOC_MARKER_FREE);
+      run_start = pos;
+      run_end   = finfo->medium_size;
+    } else if (last) {
+      // Too small for a block of it's own, let the last blob absorb it
+      size = (last_marker & (~PALLOC_MARKER_FLAGS)) + (finfo->medium_size - pos);
+      if (reseal_len && (reseal[reseal_len-1].block == last)) reseal_len--;
+      err |= _palloc_repair_push(&reseal, &reseal_len, &reseal_cap, last, size);
+    }
+  }
+  if (run_end) err |= _palloc_repair_push(&runs, &runs_len, &runs_cap, run_start, (run_end - run_start - (sizeof(PALLOC_SIZE)*2)) | PALLOC_MARKER_FREE);
+
+  // Trailing free space is returned on dynamic mediums
+  if (runs_len && (finfo->flags & PALLOC_DYNAMIC)) {
+    size = runs[runs_len-1].marker & (~PALLOC_MARKER_FLAGS);
+    if ((runs[runs_len-1].block + size + (sizeof(PALLOC_SIZE)*2)) >= finfo->medium_size) {
+      runs_len--;
+      _palloc_truncate(finfo, runs[runs_len].block);
+      finfo->medium_size = runs[runs_len].block;
+    }
+  }
+
+  // Single ascending write pass, relinking every free block
+  for(i = 0, j = 0; !err && ((i < runs_len) || (j < reseal_len));) {
+    if ((j < reseal_len) && ((i >= runs_len) || (reseal[j].block < runs[i].block))) {
+      err |= _palloc_repair_write(finfo, &reseal[j++], 0, 0);
+      continue;
+    }
+    err |= _palloc_repair_write(finfo, &runs[i],
+      i                    ? runs[i-1].block : 0,
+      (i + 1) < runs_len   ? runs[i+1].block : 0
+    );
+    i++;
+  }
+  finfo->first_free = runs_len ? runs[0].block : 0;
+  _palloc_extent_reset(finfo);
+
+  // Deferred frees have been linked by now
+  finfo->pending_len = 0;
+
+  free(runs);
+  free(reseal);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  if (err) {
+    perror("palloc_repair");
+    return PALLOC_ERR;
+  }
+  return PALLOC_OK;
+}
+
+// Granularity at which free space is handed back to the filesystem
+#define PALLOC_PAGE_SIZE 4096
+
+PALLOC_RESPONSE palloc_trim(PALLOC_FD fd, PALLOC_SIZE threshold) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_OFFSET block, start, end;
+  PALLOC_SIZE   size;
+  uint64_t      buf[3];
+
+  if (!finfo->backend->punch) return PALLOC_ERR;
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+
+  block = finfo->first_free;
+  while(block) {
+    _palloc_seek(finfo, block, SEEK_SET);
+    if (_palloc_read(finfo, buf, sizeof(buf)) != sizeof(buf)) break;
+    size = PALLOC_BETOH_SIZE(buf[0]) & (~PALLOC_MARKER_FLAGS);
+
+    // Keep the pages holding the markers, free list pointers and check slot
+    if (size >= threshold) {
+      start = block + sizeof(buf);
+      start = ((start + PALLOC_PAGE_SIZE - 1) / PALLOC_PAGE_SIZE) * PALLOC_PAGE_SIZE;
+      end   = block + sizeof(PALLOC_SIZE) + size - _palloc_check_size(finfo);
+      end   = (end / PALLOC_PAGE_SIZE) * PALLOC_PAGE_SIZE;
+      if ((end > start) && finfo->backend->punch(finfo->udata, start, end - start)) {
+        perror("palloc_trim::punch");
+        _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+        return PALLOC_ERR;
+      }
+    }
+
+    block = PALLOC_BETOH_OFFSET(buf[2]);
+  }
+
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return PALLOC_OK;
+}
+
+PALLOC_OFFSET palloc_next(PALLOC_FD fd, PALLOC_OFFSET ptr) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  uint64_t generation;
+  PALLOC_SPAN(span);
+  PALLOC_SPAN_BEGIN(span, PALLOC_TRACE_NEXT, fd, ptr, 0);
+
+  // Shared mediums are read without a lock while our cache is current and
+  // no writer is active, and the generation is unchanged afterwards
+  if ((finfo->flags & PALLOC_SHARED) && !finfo->lock_depth) {
+    generation = _palloc_generation(finfo);
+    if (!(generation & 1) && (generation == finfo->generation)) {
+      PALLOC_OFFSET result = _palloc_next(finfo, ptr, finfo->medium_size);
+      if (_palloc_generation(finfo) == generation) {
+        PALLOC_SPAN_END(span, result, 0);
+        return result;
+      }
+    }
+  }
+
+  PALLOC_OFFSET result = 0;
+  if (!_palloc_lock(finfo, PALLOC_LOCK_READ)) {
+    result = _palloc_next(finfo, ptr, finfo->medium_size);
+    _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  }
+  PALLOC_SPAN_END(span, result, 0);
+  return result;
+}
+
+// Returns the marker of the block at offset, or 0 if no block starts there.
+// Checks the block's own markers agree, as well as those of the block before
+// it, without walking the medium from the header.
+PALLOC_SIZE _palloc_boundary(struct palloc_fd_info *finfo, PALLOC_OFFSET block) {
+  PALLOC_SIZE marker, trailing, size;
+
+  if (block < finfo->header_size) return 0;
+  marker = _palloc_marker(finfo, block);
+  if (!_palloc_intact(finfo, block, marker)) return 0;
+  _palloc_seek(finfo, block + sizeof(PALLOC_SIZE) + (marker & (~PALLOC_MARKER_FLAGS)), SEEK_SET);
+  if (_palloc_read(finfo, &trailing, sizeof(trailing)) != sizeof(trailing)) return 0;
+  if (PALLOC_BETOH_SIZE(trailing) != marker) return 0;
+  if (block == finfo->header_size) return marker;
+
+  // The block before must end right where we start
+  if (block < (finfo->header_size + (sizeof(PALLOC_SIZE)*2))) return 0;
+  _palloc_seek(finfo, block - sizeof(PALLOC_SIZE), SEEK_SET);
+  if (_palloc_read(finfo, &trailing, sizeof(trailing)) != sizeof(trailing)) return 0;
+  trailing = PALLOC_BETOH_SIZE(trailing);
+  size     = trailing & (~PALLOC_MARKER_FLAGS);
+  if (size > (block - finfo->header_size - (sizeof(PALLOC_SIZE)*2))) return 0;
+  if (_palloc_marker(finfo, block - size - (sizeof(PALLOC_SIZE)*2)) != trailing) return 0;
+  return marker;
+}
+
+PALLOC_OFFSET palloc_next_in(PALLOC_FD fd, PALLOC_OFFSET ptr, PALLOC_OFFSET start, PALLOC_OFFSET end) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_OFFSET result = 0;
+  PALLOC_SIZE   marker;
+
+  // Blobs qualify by their data offset, the iteration by block offsets
+  if (end && (end < sizeof(PALLOC_SIZE))) return 0;
+  PALLOC_OFFSET limit = end ? (end - sizeof(PALLOC_SIZE)) : finfo->medium_size;
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return 0;
+  if (ptr) {
+    result = _palloc_next(finfo, ptr, limit);
+  } else if (!start) {
+    result = _palloc_next(finfo, 0, limit);
+
+  // Start itself is included if it's an allocated blob, and must be a
+  // block's data section for the iteration to follow block boundaries
+  } else if ((start >= (finfo->header_size + sizeof(PALLOC_SIZE))) && ((start - sizeof(PALLOC_SIZE)) < MIN(limit, finfo->medium_size))) {
+    marker = _palloc_boundary(finfo, start - sizeof(PALLOC_SIZE));
+    if (!marker) {
+      result = 0;
+    } else if (!(marker & PALLOC_MARKER_HIDDEN)) {
+      result = start;
+    } else {
+      result = _palloc_next(finfo, start, limit);
+    }
+  }
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+
+  return result;
+}
+
+// Iterates backward using the trailing markers, from the block ending at end
+PALLOC_OFFSET _palloc_prev(struct palloc_fd_info *finfo, PALLOC_OFFSET end) {
+  PALLOC_SIZE   marker, leading, size;
+  PALLOC_OFFSET block;
+
+  while(end > finfo->header_size) {
+    if (end < (finfo->header_size + (sizeof(PALLOC_SIZE)*2))) return 0;
+    _palloc_seek(finfo, end - sizeof(PALLOC_SIZE), SEEK_SET);
+    if (_palloc_read(finfo, &marker, sizeof(marker)) != sizeof(marker)) return 0;
+    marker = PALLOC_BETOH_SIZE(marker);
+    size   = marker & (~PALLOC_MARKER_FLAGS);
+
+    // Both markers must agree before we jump over the block
+    if (size > (end - finfo->header_size - (sizeof(PALLOC_SIZE)*2))) return 0;
+    block   = end - size - (sizeof(PALLOC_SIZE)*2);
+    leading = _palloc_marker(finfo, block);
+    if ((leading != marker) || !_palloc_intact(finfo, block, marker)) return 0;
+
+    if (!(marker & PALLOC_MARKER_HIDDEN)) return block + sizeof(PALLOC_SIZE);
+    end = block;
+  }
+
+  return 0;
+}
+
+PALLOC_OFFSET palloc_prev(PALLOC_FD fd, PALLOC_OFFSET ptr) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return 0;
+  PALLOC_OFFSET result = _palloc_prev(finfo, ptr ? (ptr - sizeof(PALLOC_SIZE)) : finfo->medium_size);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return result;
+}
+
+// Sets a flag in an allocated blob's markers, like it being internal and
+// hidden from iteration
+void _palloc_mark(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr, PALLOC_SIZE flag) {
+  PALLOC_OFFSET block  = ptr - sizeof(PALLOC_SIZE);
+  PALLOC_SIZE   marker = _palloc_marker(finfo, block) | flag;
+  PALLOC_SIZE   be     = PALLOC_HTOBE_SIZE(marker);
+  _palloc_seek(finfo, block, SEEK_SET);
+  _palloc_write(finfo, &be, sizeof(be));
+  _palloc_seek(finfo, ptr + (marker & (~PALLOC_MARKER_FLAGS)), SEEK_SET);
+  _palloc_write(finfo, &be, sizeof(be));
+  _palloc_seal(finfo, block, marker);
+}
+
+// Reads up to count bytes of a blob's logical data, decompressing if needed
+int64_t _palloc_load(struct palloc_fd_info *finfo, PALLOC_OFFSET ptr, void *buf, PALLOC_SIZE count) {
+  PALLOC_SIZE   marker = _palloc_marker(finfo, ptr - sizeof(PALLOC_SIZE));
+  PALLOC_SIZE   room   = (marker & (~PALLOC_MARKER_FLAGS)) - _palloc_check_size(finfo);
+  PALLOC_SIZE   hdr[2];
+  unsigned char *packed, *full = NULL;
+  int64_t       n = -1;
+
+  if (marker & PALLOC_MARKER_HIDDEN) return -1;
+  if (!(marker & PALLOC_MARKER_COMPRESSED)) {
+    _palloc_seek(finfo, ptr, SEEK_SET);
+    return _palloc_read(finfo, buf, MIN(count, room));
+  }
+
+  _palloc_seek(finfo, ptr, SEEK_SET);
+  if (_palloc_read(finfo, hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+  hdr[0] = PALLOC_BETOH_SIZE(hdr[0]);
+  hdr[1] = PALLOC_BETOH_SIZE(hdr[1]);
+  if (hdr[1] > (room - PALLOC_COMPRESS_HEADER)) return -1;
+  packed = malloc(hdr[1]);
+  if (!packed) return -1;
+
+  // Partial loads decompress into a scratch buffer
+  if (count < hdr[0]) full = malloc(hdr[0]);
+  if ((count >= hdr[0]) || full) {
+    if (_palloc_read(finfo, packed, hdr[1]) == hdr[1]) {
+      n = _palloc_lz_decompress(packed, hdr[1], full ? full : buf, hdr[0]);
+    }
+  }
+  if (n != (int64_t)hdr[0]) n = -1;
+  if ((n >= 0) && full) {
+    memcpy(buf, full, count);
+    n = count;
+  }
+
+  free(full);
+  free(packed);
+  return n;
+}
+
+PALLOC_OFFSET palloc_store(PALLOC_FD fd, const void *data, PALLOC_SIZE size) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  unsigned char *buf = NULL;
+  PALLOC_SIZE   packed = 0;
+  PALLOC_OFFSET ptr;
+  PALLOC_SPAN(span);
+  PALLOC_SPAN_BEGIN(span, PALLOC_TRACE_PALLOC, fd, 0, size);
+
+  // Only stored compressed when that saves space
+  if ((finfo->flags & PALLOC_COMPRESS) && (size > PALLOC_COMPRESS_HEADER)) {
+    buf = malloc(size);
+    if (buf) packed = _palloc_lz_compress(data, size, buf + PALLOC_COMPRESS_HEADER, size - PALLOC_COMPRESS_HEADER - 1);
+  }
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) {
+    free(buf);
+    PALLOC_SPAN_END(span, 0, size);
+    return 0;
+  }
+  if (packed) {
+    ((PALLOC_SIZE *)buf)[0] = PALLOC_HTOBE_SIZE(size);
+    ((PALLOC_SIZE *)buf)[1] = PALLOC_HTOBE_SIZE(packed);
+    packed += PALLOC_COMPRESS_HEADER;
+    ptr     = _palloc(finfo, packed);
+    if (ptr) _palloc_mark(finfo, ptr, PALLOC_MARKER_COMPRESSED);
+    data    = buf;
+    size    = packed;
+  } else {
+    ptr     = _palloc(finfo, size);
+  }
+  if (ptr) {
+    _palloc_seek(finfo, ptr, SEEK_SET);
+    if (_palloc_write(finfo, data, size) != size) {
+      perror("palloc_store::write");
+      _pfree(finfo, ptr);
+      ptr = 0;
+    }
+  }
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+
+  free(buf);
+  PALLOC_SPAN_END(span, ptr, size);
+  return ptr;
+}
+
+int64_t palloc_load(PALLOC_FD fd, PALLOC_OFFSET ptr, void *buf, PALLOC_SIZE count) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return -1;
+  int64_t result = _palloc_load(finfo, ptr, buf, count);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return result;
+}
+
+PALLOC_SIZE palloc_logical_size(PALLOC_FD fd, PALLOC_OFFSET ptr) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return 0;
+  PALLOC_SIZE result = _palloc_data_size(finfo, ptr);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return result;
+}
+
+// Streams consecutive blocks to the medium through a single buffer. On
+// dynamic mediums blocks are laid out back-to-back at the end of the medium,
+// otherwise every block is taken from the free list and only it's data is
+// streamed.
+struct palloc_bulk {
+  struct palloc_fd_info *finfo;
+  char          *buf;
+  PALLOC_SIZE   length;
+  PALLOC_SIZE   capacity;
+  PALLOC_OFFSET start;
+  PALLOC_OFFSET block;
+  PALLOC_SIZE   size;
+  PALLOC_SIZE   written;
+  uint32_t      crc;
+  int           err;
+};
+
+void _palloc_bulk_flush(struct palloc_bulk *bulk) {
+  if (!bulk->length) return;
+  _palloc_seek(bulk->finfo, bulk->start, SEEK_SET);
+  if (_palloc_write(bulk->finfo, bulk->buf, bulk->length) != bulk->length) {
+    perror("palloc_bulk::write");
+    bulk->err = 1;
+  }
+  bulk->start += bulk->length;
+  bulk->length = 0;
+}
+
+// Buffers count bytes of data, or zeroes if data is NULL
+void _palloc_bulk_put(struct palloc_bulk *bulk, const void *data, PALLOC_SIZE count, int sum) {
+  PALLOC_SIZE chunk;
+  while(count) {
+    if (bulk->length == bulk->capacity) _palloc_bulk_flush(bulk);
+    chunk = MIN(count, bulk->capacity - bulk->length);
+    if (data) {
+      memcpy(bulk->buf + bulk->length, data, chunk);
+      data = ((const char *)data) + chunk;
+    } else {
+      memset(bulk->buf + bulk->length, 0, chunk);
+    }
+    if (sum) bulk->crc = _palloc_crc32c(bulk->crc, bulk->buf + bulk->length, chunk);
+    bulk->length += chunk;
+    count        -= chunk;
+  }
+}
+
+void _palloc_bulk_begin(struct palloc_bulk *bulk, PALLOC_SIZE size) {
+  struct palloc_fd_info *finfo = bulk->finfo;
+  PALLOC_SIZE marker;
+  PALLOC_OFFSET ptr;
+
+  bulk->written = 0;
+  bulk->crc     = 0;
+  if (!(finfo->flags & PALLOC_DYNAMIC)) {
+    _palloc_bulk_flush(bulk);
+    ptr = _palloc(finfo, size);
+    if (!ptr) {
+      bulk->err   = 1;
+      bulk->block = 0;
+      return;
+    }
+    bulk->block = ptr - sizeof(PALLOC_SIZE);
+    bulk->size  = _palloc_size(finfo, bulk->block);
+    bulk->start = ptr;
+    return;
+  }
+
+  // Same size rounding as palloc
+  if (size < (sizeof(PALLOC_OFFSET)*2)) {
+    size = sizeof(PALLOC_OFFSET) * 2;
+  }
+  bulk->size  = size + _palloc_check_size(finfo);
+  bulk->block = bulk->start + bulk->length;
+  marker      = PALLOC_HTOBE_SIZE(bulk->size);
+  _palloc_bulk_put(bulk, &marker, sizeof(marker), 0);
+}
+
+void _palloc_bulk_data(struct palloc_bulk *bulk, const void *data, PALLOC_SIZE count) {
+  PALLOC_SIZE room = bulk->size - _palloc_check_size(bulk->finfo) - bulk->written;
+  if (!bulk->block) return;
+  count = MIN(count, room);
+  _palloc_bulk_put(bulk, data, count, bulk->finfo->flags & PALLOC_CHECKSUM);
+  bulk->written += count;
+}
+
+// Finishes the current block, sealing it as we know all of it's data
+PALLOC_OFFSET _palloc_bulk_end(struct palloc_bulk *bulk) {
+  struct palloc_fd_info *finfo = bulk->finfo;
+  PALLOC_SIZE marker = PALLOC_HTOBE_SIZE(bulk->size);
+  uint64_t    check;
+
+  if (!bulk->block) return 0;
+  _palloc_bulk_data(bulk, NULL, bulk->size);
+  if (finfo->flags & PALLOC_CHECKSUM) {
+    check = htobe64((((uint64_t)_palloc_check_payload(bulk->crc)) << 32) | _palloc_check_marker(bulk->block, bulk->size));
+    _palloc_bulk_put(bulk, &check, sizeof(check), 0);
+  }
+  if (finfo->flags & PALLOC_DYNAMIC) {
+    _palloc_bulk_put(bulk, &marker, sizeof(marker), 0);
+    _palloc_record(finfo, PALLOC_RECORD_ALLOC, bulk->size - _palloc_check_size(finfo), bulk->block + sizeof(PALLOC_SIZE));
+  } else {
+    _palloc_bulk_flush(bulk);
+  }
+  return bulk->block + sizeof(PALLOC_SIZE);
+}
+
+int _palloc_bulk_open(struct palloc_bulk *bulk, struct palloc_fd_info *finfo) {
+  memset(bulk, 0, sizeof(*bulk));
+  bulk->finfo    = finfo;
+  bulk->capacity = PALLOC_STREAM_SIZE;
+  bulk->buf      = malloc(bulk->capacity);
+  bulk->start    = _palloc_seek(finfo, 0, SEEK_END);
+  if (!bulk->buf) {
+    perror("palloc_bulk::malloc");
+    return -1;
+  }
+  return 0;
+}
+
+PALLOC_RESPONSE _palloc_bulk_close(struct palloc_bulk *bulk) {
+  _palloc_bulk_flush(bulk);
+  if (bulk->finfo->flags & PALLOC_DYNAMIC) {
+    bulk->finfo->medium_size = bulk->start;
+  }
+  free(bulk->buf);
+  return bulk->err ? PALLOC_ERR : PALLOC_OK;
+}
+
+PALLOC_RESPONSE palloc_bulk(PALLOC_FD fd, PALLOC_SIZE count, const PALLOC_SIZE *sizes, const void * const *data, PALLOC_OFFSET *ptrs) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_bulk bulk;
+  PALLOC_OFFSET ptr;
+  PALLOC_SIZE   i;
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  if (_palloc_bulk_open(&bulk, finfo)) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_ERR;
+  }
+  for(i = 0; (i < count) && !bulk.err; i++) {
+    _palloc_bulk_begin(&bulk, sizes[i]);
+    _palloc_bulk_data(&bulk, data ? data[i] : NULL, sizes[i]);
+    ptr = _palloc_bulk_end(&bulk);
+    if (ptrs) ptrs[i] = ptr;
+  }
+  PALLOC_RESPONSE result = _palloc_bulk_close(&bulk);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return result;
+}
+
+#define PALLOC_EXPORT_MAGIC "PBX\0"
+
+// Buffered output for palloc_export
+struct palloc_export {
+  int64_t     (*write)(const void *buf, PALLOC_SIZE count, void *udata);
+  void        *udata;
+  char        *buf;
+  PALLOC_SIZE length;
+  PALLOC_SIZE capacity;
+  int         err;
+};
+
+void _palloc_export_flush(struct palloc_export *out) {
+  if (out->length && !out->err) {
+    if (out->write(out->buf, out->length, out->udata) != out->length) {
+      out->err = 1;
     }
-    if (write_os(fd, &free_nnext, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
-      perror("palloc::write");
-      return 0;
+  }
+  out->length = 0;
+}
+
+void _palloc_export_put(struct palloc_export *out, const void *data, PALLOC_SIZE count) {
+  PALLOC_SIZE chunk;
+  while(count) {
+    if (out->length == out->capacity) _palloc_export_flush(out);
+    chunk = MIN(count, out->capacity - out->length);
+    memcpy(out->buf + out->length, data, chunk);
+    out->length += chunk;
+    data         = ((const char *)data) + chunk;
+    count       -= chunk;
+  }
+}
+
+// Passes count bytes of the medium from data_pos on to the export
+void _palloc_export_range(struct palloc_export *out, struct palloc_stream *stream, PALLOC_OFFSET data_pos, PALLOC_SIZE count) {
+  PALLOC_SIZE chunk;
+  const char  *data;
+  while(count && !out->err) {
+    chunk = MIN(count, stream->capacity);
+    data  = _palloc_stream_peek(stream, data_pos, chunk);
+    if (!data) {
+      out->err = 1;
+      break;
     }
-    seek_os(fd, (PALLOC_BETOH_SIZE(marker) & (~PALLOC_MARKER_FREE)) - (sizeof(PALLOC_OFFSET)*2), SEEK_CUR);
-    if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-      perror("palloc::write");
-      return 0;
+    _palloc_export_put(out, data, chunk);
+    data_pos += chunk;
+    count    -= chunk;
+  }
+}
+
+PALLOC_RESPONSE palloc_export(PALLOC_FD fd, int64_t (*write)(const void *buf, PALLOC_SIZE count, void *udata), void *udata) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_stream stream = { .finfo = finfo, .capacity = PALLOC_STREAM_SIZE };
+  struct palloc_export out    = { .write = write, .udata = udata, .capacity = PALLOC_STREAM_SIZE };
+  PALLOC_SIZE   marker, size, record, count, i;
+  PALLOC_OFFSET pos, *list;
+  const char    *data;
+  char          *buf;
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return PALLOC_ERR;
+  stream.buf = malloc(stream.capacity);
+  out.buf    = malloc(out.capacity);
+  if (!stream.buf || !out.buf) {
+    perror("palloc_export::malloc");
+    out.err = 1;
+  }
+
+  // Only the data of live blobs is written, in medium order
+  if (!out.err) _palloc_export_put(&out, PALLOC_EXPORT_MAGIC, 4);
+  pos = finfo->header_size;
+  while(pos && (pos < finfo->medium_size) && !out.err) {
+    data = _palloc_stream_peek(&stream, pos, sizeof(marker));
+    if (!data) break;
+    memcpy(&marker, data, sizeof(marker));
+    marker = PALLOC_BETOH_SIZE(marker);
+    size   = marker & (~PALLOC_MARKER_FLAGS);
+    if (
+      (size < ((sizeof(PALLOC_OFFSET)*2) + _palloc_check_size(finfo))) ||
+      ((pos + size + (sizeof(PALLOC_SIZE)*2)) > finfo->medium_size)
+    ) {
+      out.err = 1;
+      break;
     }
-    // Update next block's pointer
-    free_nnext = PALLOC_BETOH_OFFSET(free_nnext);
-    if (free_nnext) {
-      seek_os(fd, free_nnext + sizeof(PALLOC_SIZE), SEEK_SET);
-      if (write_os(fd, &free_pprev, sizeof(PALLOC_OFFSET)) != sizeof(PALLOC_OFFSET)) {
-        perror("palloc::write");
-        return 0;
+    // Compressed blobs are exported as their logical data
+    if ((marker & PALLOC_MARKER_COMPRESSED) && !(marker & PALLOC_MARKER_HIDDEN)) {
+      size   = _palloc_data_size(finfo, pos + sizeof(PALLOC_SIZE));
+      record = PALLOC_HTOBE_SIZE(size);
+      buf    = malloc(size ? size : 1);
+      if (!buf || (_palloc_load(finfo, pos + sizeof(PALLOC_SIZE), buf, size) != size)) {
+        out.err = 1;
+      } else {
+        _palloc_export_put(&out, &record, sizeof(record));
+        _palloc_export_put(&out, buf, size);
       }
+      free(buf);
+
+    // Chains are exported as their logical data, extent by extent
+    } else if ((marker & PALLOC_MARKER_CHAIN) && !(marker & PALLOC_MARKER_HIDDEN)) {
+      list = _palloc_chain_load(finfo, pos + sizeof(PALLOC_SIZE), &size, &count);
+      if (!list) {
+        out.err = 1;
+      } else {
+        record = PALLOC_HTOBE_SIZE(size);
+        _palloc_export_put(&out, &record, sizeof(record));
+        for(i = 0; i < count; i++) {
+          _palloc_export_range(&out, &stream, list[i*2], list[(i*2)+1]);
+        }
+        free(list);
+      }
+    } else if (!(marker & PALLOC_MARKER_HIDDEN)) {
+      size   = size - _palloc_check_size(finfo);
+      record = PALLOC_HTOBE_SIZE(size);
+      _palloc_export_put(&out, &record, sizeof(record));
+      _palloc_export_range(&out, &stream, pos + sizeof(PALLOC_SIZE), size);
     }
+    pos += (marker & (~PALLOC_MARKER_FLAGS)) + (sizeof(PALLOC_SIZE)*2);
   }
+  _palloc_export_flush(&out);
 
-  // Size is now block size, not given size
-  size = _palloc_size(fd, selected);
+  free(stream.buf);
+  free(out.buf);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return out.err ? PALLOC_ERR : PALLOC_OK;
+}
 
-  // Remove selected free block from the doubly-linked-list
-  seek_os(fd, selected + sizeof(PALLOC_SIZE), SEEK_SET);
-  read_os(fd, &free_prev, sizeof(PALLOC_OFFSET));
-  read_os(fd, &free_next, sizeof(PALLOC_OFFSET));
-  free_prev = PALLOC_BETOH_OFFSET(free_prev);
-  free_next = PALLOC_BETOH_OFFSET(free_next);
-  if (free_prev) {
-    free_next = PALLOC_HTOBE_OFFSET(free_next);
-    seek_os(fd, free_prev + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
-    write_os(fd, &free_next, sizeof(PALLOC_OFFSET));
-    free_next = PALLOC_BETOH_OFFSET(free_next);
+// Reads exactly count bytes, returns whether that succeeded
+int _palloc_import_read(int64_t (*read)(void *buf, PALLOC_SIZE count, void *udata), void *udata, void *buf, PALLOC_SIZE count) {
+  int64_t n;
+  while(count) {
+    n = read(buf, count, udata);
+    if (n <= 0) return 0;
+    buf    = ((char *)buf) + n;
+    count -= n;
   }
-  if (free_next) {
-    free_prev = PALLOC_HTOBE_OFFSET(free_prev);
-    seek_os(fd, free_next + sizeof(PALLOC_SIZE), SEEK_SET);
-    write_os(fd, &free_prev, sizeof(PALLOC_OFFSET));
-    free_prev = PALLOC_BETOH_OFFSET(free_prev);
+  return 1;
+}
+
+PALLOC_RESPONSE palloc_import(PALLOC_FD fd, int64_t (*read)(void *buf, PALLOC_SIZE count, void *udata), void *udata) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_bulk bulk;
+  PALLOC_SIZE   size, chunk;
+  int64_t       n;
+  char          magic[4];
+  char          *buf;
+
+  if (!_palloc_import_read(read, udata, magic, sizeof(magic))) return PALLOC_ERR;
+  if (memcmp(magic, PALLOC_EXPORT_MAGIC, sizeof(magic))) return PALLOC_ERR;
+  buf = malloc(PALLOC_STREAM_SIZE);
+  if (!buf) {
+    perror("palloc_import::malloc");
+    return PALLOC_ERR;
   }
 
-  // Fix first free
-  if (finfo->first_free == selected) {
-    finfo->first_free = free_next;
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) {
+    free(buf);
+    return PALLOC_ERR;
+  }
+  if (_palloc_bulk_open(&bulk, finfo)) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    free(buf);
+    return PALLOC_ERR;
   }
 
-  // Mark selected block as non-free
-  marker = PALLOC_HTOBE_SIZE(size);
-  seek_os(fd, selected, SEEK_SET);
-  if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-    perror("palloc::write");
-    return 0;
+  // Records until the end of the stream, a cut-off record is an error
+  while(!bulk.err) {
+    n = read(&size, sizeof(size), udata);
+    if (n == 0) break;
+    if ((n < 0) || !_palloc_import_read(read, udata, ((char *)&size) + n, sizeof(size) - n)) {
+      bulk.err = 1;
+      break;
+    }
+    size = PALLOC_BETOH_SIZE(size);
+    _palloc_bulk_begin(&bulk, size);
+    while(size && !bulk.err) {
+      chunk = MIN(size, PALLOC_STREAM_SIZE);
+      if (!_palloc_import_read(read, udata, buf, chunk)) {
+        bulk.err = 1;
+        break;
+      }
+      _palloc_bulk_data(&bulk, buf, chunk);
+      size -= chunk;
+    }
+    _palloc_bulk_end(&bulk);
   }
-  seek_os(fd, size, SEEK_CUR);
-  if (write_os(fd, &marker, sizeof(PALLOC_SIZE)) != sizeof(PALLOC_SIZE)) {
-    perror("palloc::write");
-    return 0;
+
+  PALLOC_RESPONSE result = _palloc_bulk_close(&bulk);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  free(buf);
+  return result;
+}
+
+// Copies count bytes within the medium through a bounded buffer
+int _palloc_copy(struct palloc_fd_info *finfo, PALLOC_OFFSET dst, PALLOC_OFFSET src, PALLOC_SIZE count) {
+  char        *buf = malloc(MIN(count, PALLOC_STREAM_SIZE));
+  PALLOC_SIZE chunk;
+  if (count && !buf) return -1;
+  while(count) {
+    chunk = MIN(count, PALLOC_STREAM_SIZE);
+    _palloc_seek(finfo, src, SEEK_SET);
+    if (_palloc_read(finfo, buf, chunk) != chunk) break;
+    _palloc_seek(finfo, dst, SEEK_SET);
+    if (_palloc_write(finfo, buf, chunk) != chunk) break;
+    src   += chunk;
+    dst   += chunk;
+    count -= chunk;
   }
+  free(buf);
+  return count ? -1 : 0;
+}
 
-  // And return the pointer to the start of the data
-  return selected + sizeof(PALLOC_SIZE);
+#define PALLOC_HANDLES_INITIAL 64
+
+// Header field holding the offset of the handle table's data
+PALLOC_OFFSET _palloc_handles_anchor(struct palloc_fd_info *finfo) {
+  return _palloc_header_size(finfo->flags & (~PALLOC_HANDLES));
 }
 
-void _pfree_merge(PALLOC_FD fd, PALLOC_OFFSET left, PALLOC_OFFSET right) {
-  PALLOC_SIZE left_marker  = _palloc_marker(fd, left );
-  PALLOC_SIZE right_marker = _palloc_marker(fd, right);
-  PALLOC_SIZE left_size    = left_marker  & (~PALLOC_MARKER_FREE);
-  PALLOC_SIZE right_size   = right_marker & (~PALLOC_MARKER_FREE);
-  PALLOC_OFFSET right_next;
+void _palloc_handles_reset(struct palloc_fd_info *finfo) {
+  free(finfo->handles);
+  finfo->handles       = NULL;
+  finfo->handles_table = 0;
+  finfo->handles_len   = 0;
+  finfo->handles_hint  = 0;
+  finfo->handles_valid = 0;
+}
 
-  // Not both free = do not merge
-  if (!(left_marker & right_marker & PALLOC_MARKER_FREE)) {
-    return;
+// Reads the whole handle table into memory, if not done yet
+int _palloc_handles_load(struct palloc_fd_info *finfo) {
+  PALLOC_OFFSET table;
+  PALLOC_SIZE   i, len = 0;
+
+  if (finfo->handles_valid) return 0;
+  if (!(finfo->flags & PALLOC_HANDLES)) return -1;
+  _palloc_seek(finfo, _palloc_handles_anchor(finfo), SEEK_SET);
+  if (_palloc_read(finfo, &table, sizeof(table)) != sizeof(table)) return -1;
+  table = PALLOC_BETOH_OFFSET(table);
+
+  _palloc_handles_reset(finfo);
+  if (table) {
+    len            = (_palloc_size(finfo, table - sizeof(PALLOC_SIZE)) - _palloc_check_size(finfo)) / sizeof(PALLOC_OFFSET);
+    finfo->handles = malloc(len * sizeof(PALLOC_OFFSET));
+    if (!finfo->handles) {
+      perror("palloc_handles::malloc");
+      return -1;
+    }
+    _palloc_seek(finfo, table, SEEK_SET);
+    if (_palloc_read(finfo, finfo->handles, len * sizeof(PALLOC_OFFSET)) != (len * sizeof(PALLOC_OFFSET))) {
+      _palloc_handles_reset(finfo);
+      return -1;
+    }
+    for(i = 0; i < len; i++) {
+      finfo->handles[i] = PALLOC_BETOH_OFFSET(finfo->handles[i]);
+    }
   }
 
-  // Not consecutive = do not merge
-  if ((left + left_size + (sizeof(PALLOC_SIZE)*2)) != right) {
-    return;
+  finfo->handles_table = table;
+  finfo->handles_len   = len;
+  finfo->handles_valid = 1;
+  return 0;
+}
+
+// Moves the handle table into a blob twice it's size
+int _palloc_handles_grow(struct palloc_fd_info *finfo) {
+  PALLOC_SIZE   i, len = finfo->handles_len ? (finfo->handles_len * 2) : PALLOC_HANDLES_INITIAL;
+  PALLOC_OFFSET table, anchor, *grown, *buf;
+
+  table = _palloc(finfo, len * sizeof(PALLOC_OFFSET));
+  if (!table) return -1;
+
+  // The blob may be larger than asked, all of it is table
+  len   = (_palloc_size(finfo, table - sizeof(PALLOC_SIZE)) - _palloc_check_size(finfo)) / sizeof(PALLOC_OFFSET);
+  grown = realloc(finfo->handles, len * sizeof(PALLOC_OFFSET));
+  buf   = malloc(len * sizeof(PALLOC_OFFSET));
+  if (grown) finfo->handles = grown;
+  if (!grown || !buf) {
+    perror("palloc_handles::malloc");
+    free(buf);
+    _pfree(finfo, table);
+    return -1;
+  }
+  memset(grown + finfo->handles_len, 0, (len - finfo->handles_len) * sizeof(PALLOC_OFFSET));
+  for(i = 0; i < len; i++) {
+    buf[i] = PALLOC_HTOBE_OFFSET(grown[i]);
+  }
+  _palloc_seek(finfo, table, SEEK_SET);
+  i = _palloc_write(finfo, buf, len * sizeof(PALLOC_OFFSET));
+  free(buf);
+  if (i != (len * sizeof(PALLOC_OFFSET))) {
+    perror("palloc_handles::write");
+    _pfree(finfo, table);
+    return -1;
   }
+  _palloc_mark(finfo, table, PALLOC_MARKER_INTERNAL);
+
+  // Point the header to the new table before dropping the old one
+  anchor = PALLOC_HTOBE_OFFSET(table);
+  _palloc_seek(finfo, _palloc_handles_anchor(finfo), SEEK_SET);
+  if (_palloc_write(finfo, &anchor, sizeof(anchor)) != sizeof(anchor)) {
+    perror("palloc_handles::write");
+    _pfree(finfo, table);
+    return -1;
+  }
+  if (finfo->handles_table) _pfree(finfo, finfo->handles_table);
+  finfo->handles_table = table;
+  finfo->handles_len   = len;
+  return 0;
+}
 
-  // Read the right_next, as that'll become our next
-  seek_os(fd, right + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
-  read_os(fd, &right_next, sizeof(PALLOC_OFFSET));
+int _palloc_handles_set(struct palloc_fd_info *finfo, PALLOC_SIZE index, PALLOC_OFFSET ptr) {
+  PALLOC_OFFSET entry = PALLOC_HTOBE_OFFSET(ptr);
+  _palloc_seek(finfo, finfo->handles_table + (index * sizeof(PALLOC_OFFSET)), SEEK_SET);
+  if (_palloc_write(finfo, &entry, sizeof(entry)) != sizeof(entry)) {
+    perror("palloc_handles::write");
+    return -1;
+  }
+  finfo->handles[index] = ptr;
+  if (!ptr) finfo->handles_hint = MIN(finfo->handles_hint, index);
+  return 0;
+}
 
-  // Actually merge the blocks into 1 big one
-  left_size   = left_size + right_size + (sizeof(PALLOC_SIZE)*2);
-  left_marker = PALLOC_HTOBE_SIZE(left_size | PALLOC_MARKER_FREE);
-  seek_os(fd, left, SEEK_SET);
-  write_os(fd, &left_marker, sizeof(left_marker));
-  seek_os(fd, sizeof(PALLOC_OFFSET), SEEK_CUR);
-  write_os(fd, &right_next, sizeof(right_next));
-  seek_os(fd, left_size - (sizeof(PALLOC_OFFSET)*2), SEEK_CUR);
-  write_os(fd, &left_marker, sizeof(left_marker));
+// Relocates the blob behind a handle, keeping it's data and seal
+PALLOC_OFFSET _palloc_move(struct palloc_fd_info *finfo, PALLOC_SIZE index, PALLOC_OFFSET near) {
+  PALLOC_OFFSET src = finfo->handles[index], dst;
+  PALLOC_SIZE   size;
+  uint64_t      check = 0;
 
-  // Update right_next's prev pointer
-  if (PALLOC_BETOH_OFFSET(right_next)) {
-    left = PALLOC_HTOBE_OFFSET(left);
-    seek_os(fd, PALLOC_BETOH_OFFSET(right_next) + sizeof(PALLOC_SIZE), SEEK_SET);
-    write_os(fd, &left, sizeof(left));
-    left = PALLOC_BETOH_OFFSET(left);
+  size = _palloc_size(finfo, src - sizeof(PALLOC_SIZE)) - _palloc_check_size(finfo);
+  if (finfo->flags & PALLOC_CHECKSUM) {
+    _palloc_seek(finfo, src + size, SEEK_SET);
+    _palloc_read(finfo, &check, sizeof(check));
+  }
+  dst = _palloc_near(finfo, size, near);
+  if (!dst) return 0;
+  if (_palloc_copy(finfo, dst, src, size) || _palloc_handles_set(finfo, index, dst)) {
+    _pfree(finfo, dst);
+    return 0;
   }
+  _pfree(finfo, src);
+  if (be64toh(check) >> 32) palloc_seal(finfo->fd, dst);
+  return dst;
 }
 
-PALLOC_RESPONSE pfree(PALLOC_FD fd, PALLOC_OFFSET ptr) {
-  PALLOC_SIZE marker, size;
-  PALLOC_OFFSET off_left, off_right;
+PALLOC_HANDLE palloc_handle(PALLOC_FD fd, PALLOC_SIZE size) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_OFFSET ptr;
+  PALLOC_SIZE   i;
 
-  // Convert pointer to outer
-  ptr -= sizeof(PALLOC_SIZE);
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return 0;
+  if (_palloc_handles_load(finfo)) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return 0;
+  }
+
+  // Lowest unused slot, growing the table if there is none
+  for(i = finfo->handles_hint; (i < finfo->handles_len) && finfo->handles[i]; i++);
+  if ((i == finfo->handles_len) && _palloc_handles_grow(finfo)) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return 0;
+  }
+
+  ptr = _palloc(finfo, size);
+  if (!ptr || _palloc_handles_set(finfo, i, ptr)) {
+    if (ptr) _pfree(finfo, ptr);
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return 0;
+  }
+  finfo->handles_hint = i + 1;
+
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return i + 1;
+}
 
-  // Fetch info
+PALLOC_OFFSET palloc_resolve(PALLOC_FD fd, PALLOC_HANDLE handle) {
   struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_OFFSET result = 0;
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return 0;
+  if (!_palloc_handles_load(finfo) && handle && (handle <= finfo->handles_len)) {
+    result = finfo->handles[handle - 1];
+  }
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return result;
+}
 
-  // Get the pointer's own marker in advance
-  // Bail early if already free
-  seek_os(fd, ptr, SEEK_SET);
-  read_os(fd, &marker, sizeof(PALLOC_SIZE));
-  marker = PALLOC_BETOH_SIZE(marker);
-  if (marker & PALLOC_MARKER_FREE) {
-    return PALLOC_OK;
+PALLOC_RESPONSE pfree_handle(PALLOC_FD fd, PALLOC_HANDLE handle) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_RESPONSE result = PALLOC_ERR;
+  PALLOC_OFFSET   ptr;
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  if (!_palloc_handles_load(finfo) && handle && (handle <= finfo->handles_len)) {
+    ptr = finfo->handles[handle - 1];
+    if (ptr && !_palloc_handles_set(finfo, handle - 1, 0)) {
+      result = _pfree(finfo, ptr);
+    }
   }
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return result;
+}
 
-  // Detect free neighbours
-  PALLOC_OFFSET free_prev = 0;
-  PALLOC_OFFSET free_next = 0;
-  PALLOC_OFFSET free_cur  = finfo->first_free;
-  while(free_cur) {
-    if (free_cur < ptr)   free_prev = free_cur;
-    if (free_cur > ptr) { free_next = free_cur; break; }
-    seek_os(fd, free_cur + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
-    read_os(fd, &free_cur, sizeof(PALLOC_OFFSET));
-    free_cur = PALLOC_BETOH_OFFSET(free_cur);
+PALLOC_OFFSET palloc_move(PALLOC_FD fd, PALLOC_HANDLE handle, PALLOC_OFFSET near) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_OFFSET result = 0;
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return 0;
+  if (!_palloc_handles_load(finfo) && handle && (handle <= finfo->handles_len) && finfo->handles[handle - 1]) {
+    result = _palloc_move(finfo, handle - 1, near);
   }
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return result;
+}
 
-  // We need BE pointers during the next block
-  free_prev = PALLOC_HTOBE_OFFSET(free_prev);
-  free_next = PALLOC_HTOBE_OFFSET(free_next);
+PALLOC_SIZE palloc_compact(PALLOC_FD fd) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_extent *fit;
+  PALLOC_SIZE i, moved = 0;
 
-  // Mark ourselves as free & link into free list
-  seek_os(fd, ptr, SEEK_SET);
-  read_os(fd, &marker, sizeof(PALLOC_SIZE));
-  size   = PALLOC_BETOH_SIZE(marker) & (~PALLOC_MARKER_FREE);
-  marker = PALLOC_HTOBE_SIZE(size | PALLOC_MARKER_FREE);
-  seek_os(fd, ptr, SEEK_SET);
-  write_os(fd, &marker, sizeof(marker));
-  write_os(fd, &free_prev, sizeof(free_prev));
-  write_os(fd, &free_next, sizeof(free_next));
-  seek_os(fd, size - (sizeof(PALLOC_SIZE)*2), SEEK_CUR);
-  write_os(fd, &marker, sizeof(marker));
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return 0;
+  if (_palloc_handles_load(finfo)) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return 0;
+  }
+  _palloc_flush(finfo);
+
+  // Every blob moves to the first free block before it that fits
+  for(i = 0; i < finfo->handles_len; i++) {
+    if (!finfo->handles[i]) continue;
+    _palloc_extent_build(finfo);
+    fit = _palloc_extent_fit(finfo->extents, _palloc_size(finfo, finfo->handles[i] - sizeof(PALLOC_SIZE)));
+    if (!fit || (fit->offset > finfo->handles[i])) continue;
+    if (_palloc_move(finfo, i, 0)) moved++;
+  }
 
-  // Update first_free if needed
-  if ((!(finfo->first_free)) || (finfo->first_free > ptr)) {
-    finfo->first_free = ptr;
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return moved;
+}
+
+// Chain heads hold the logical size, extent count and extent list
+#define PALLOC_CHAIN_HEADER (sizeof(PALLOC_SIZE)*2)
+#define PALLOC_CHAIN_ENTRY  (sizeof(PALLOC_OFFSET) + sizeof(PALLOC_SIZE))
+
+// Reads a chain's extent list, which the caller must free
+PALLOC_OFFSET * _palloc_chain_load(struct palloc_fd_info *finfo, PALLOC_OFFSET head, PALLOC_SIZE *size, PALLOC_SIZE *count) {
+  PALLOC_OFFSET *list;
+  PALLOC_SIZE   i, hdr[2], capacity, marker;
+
+  marker = _palloc_marker(finfo, head - sizeof(PALLOC_SIZE));
+  if ((marker & (PALLOC_MARKER_CHAIN | PALLOC_MARKER_HIDDEN)) != PALLOC_MARKER_CHAIN) return NULL;
+  capacity = ((marker & (~PALLOC_MARKER_FLAGS)) - _palloc_check_size(finfo) - PALLOC_CHAIN_HEADER) / PALLOC_CHAIN_ENTRY;
+  _palloc_seek(finfo, head, SEEK_SET);
+  if (_palloc_read(finfo, hdr, sizeof(hdr)) != sizeof(hdr)) return NULL;
+  *size  = PALLOC_BETOH_SIZE(hdr[0]);
+  *count = PALLOC_BETOH_SIZE(hdr[1]);
+  if (!*count || (*count > capacity)) return NULL;
+
+  list = malloc(*count * PALLOC_CHAIN_ENTRY);
+  if (!list) return NULL;
+  if (_palloc_read(finfo, list, *count * PALLOC_CHAIN_ENTRY) != (*count * PALLOC_CHAIN_ENTRY)) {
+    free(list);
+    return NULL;
   }
+  for(i = 0; i < (*count * 2); i++) {
+    list[i] = PALLOC_BETOH_OFFSET(list[i]);
+  }
+  return list;
+}
 
-  // We need H pointers during the next block
-  free_prev = PALLOC_BETOH_OFFSET(free_prev);
-  free_next = PALLOC_BETOH_OFFSET(free_next);
+// Frees a chain's extents, followed by the head itself
+void _pfree_chain(struct palloc_fd_info *finfo, PALLOC_OFFSET head, PALLOC_OFFSET *list, PALLOC_SIZE count) {
+  PALLOC_SIZE i;
+  for(i = 0; i < count; i++) {
+    _pfree(finfo, list[i*2]);
+  }
+  _pfree(finfo, head);
+}
 
-  // Update our neighbours' pointers
-  if (free_prev) {
-    seek_os(fd, free_prev + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
-    off_left = PALLOC_HTOBE_OFFSET(ptr);
-    write_os(fd, &off_left, sizeof(PALLOC_SIZE));
+PALLOC_OFFSET palloc_chain(PALLOC_FD fd, PALLOC_SIZE size) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  struct palloc_extent *node;
+  PALLOC_OFFSET head, cursor, ptr, *list;
+  PALLOC_SIZE   check = _palloc_check_size(finfo);
+  PALLOC_SIZE   i, count = 0, capacity = 0, remaining = size, take;
+
+  if (!size) return 0;
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return 0;
+  _palloc_flush(finfo);
+  _palloc_extent_build(finfo);
+
+  // Count the free blocks needed, in ascending order, plus room for a tail
+  // extent and the block the head itself may split
+  for(cursor = _palloc_extent_next(finfo->extents, 0); cursor && remaining; cursor = _palloc_extent_next(finfo->extents, cursor)) {
+    node       = _palloc_extent_find(finfo->extents, cursor);
+    remaining -= MIN(remaining, node->size - check);
+    capacity++;
   }
-  if (free_next) {
-    seek_os(fd, free_next + sizeof(PALLOC_SIZE), SEEK_SET);
-    off_right = PALLOC_HTOBE_OFFSET(ptr);
-    write_os(fd, &off_right, sizeof(PALLOC_SIZE));
+  if (remaining && !(finfo->flags & PALLOC_DYNAMIC)) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return 0;
+  }
+  capacity += 2;
+  list      = calloc(capacity * 2, sizeof(PALLOC_OFFSET));
+  head      = list ? _palloc(finfo, PALLOC_CHAIN_HEADER + (capacity * PALLOC_CHAIN_ENTRY)) : 0;
+  if (!head) {
+    free(list);
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return 0;
   }
 
-  // Merge with neighbours if consecutive
-  // Next first, so we don't need to update our tracking
-  if (free_next) { _pfree_merge(fd, ptr, free_next); }
-  if (free_prev) { _pfree_merge(fd, free_prev, ptr); ptr = free_prev; }
+  // Stitch the blob from free blocks in ascending order, keeping the last
+  // slot for a tail extent on dynamic mediums
+  remaining = size;
+  cursor    = 0;
+  while(remaining && (count < capacity)) {
+    cursor = _palloc_extent_next(finfo->extents, cursor);
+    if (cursor && (((count + 1) < capacity) || !(finfo->flags & PALLOC_DYNAMIC))) {
+      node = _palloc_extent_find(finfo->extents, cursor);
+      take = MIN(remaining, node->size - check);
+      ptr  = _palloc_near(finfo, take, cursor);
+    } else if (finfo->flags & PALLOC_DYNAMIC) {
+      take = remaining;
+      ptr  = _palloc_append(finfo, MAX(take, sizeof(PALLOC_OFFSET)*2) + check);
+      if (ptr) _palloc_record(finfo, PALLOC_RECORD_ALLOC, take, ptr);
+    } else {
+      break;
+    }
+    if (!ptr) break;
+    _palloc_mark(finfo, ptr, PALLOC_MARKER_INTERNAL);
+    list[count*2]     = ptr;
+    list[(count*2)+1] = take;
+    remaining        -= take;
+    count++;
+  }
+  if (remaining) {
+    _pfree_chain(finfo, head, list, count);
+    free(list);
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return 0;
+  }
 
-  // Truncate if last in file
-  if (finfo->flags & PALLOC_DYNAMIC) {
-    size = _palloc_size(fd, ptr);
-    if (ptr + size + (sizeof(PALLOC_SIZE)*2) >= finfo->medium_size) {
+  // Head written in a single go
+  for(i = 0; i < (count * 2); i++) {
+    list[i] = PALLOC_HTOBE_OFFSET(list[i]);
+  }
+  take = PALLOC_HTOBE_SIZE(size);
+  _palloc_seek(finfo, head, SEEK_SET);
+  _palloc_write(finfo, &take, sizeof(take));
+  take = PALLOC_HTOBE_SIZE(count);
+  _palloc_write(finfo, &take, sizeof(take));
+  _palloc_write(finfo, list, count * PALLOC_CHAIN_ENTRY);
+  _palloc_mark(finfo, head, PALLOC_MARKER_CHAIN);
+
+  free(list);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return head;
+}
 
-      // Remove free_prev's next pointer
-      seek_os(fd, ptr + sizeof(PALLOC_SIZE), SEEK_SET);
-      read_os(fd, &free_prev, sizeof(free_prev));
-      free_prev = PALLOC_BETOH_OFFSET(free_prev);
-      if (free_prev) {
-        free_next = PALLOC_HTOBE_OFFSET(0);
-        seek_os(fd, free_prev + sizeof(PALLOC_SIZE) + sizeof(PALLOC_OFFSET), SEEK_SET);
-        write_os(fd, &free_next, sizeof(free_next));
-      }
+PALLOC_SIZE palloc_chain_size(PALLOC_FD fd, PALLOC_OFFSET head) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_OFFSET *list;
+  PALLOC_SIZE size = 0, count;
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return 0;
+  list = _palloc_chain_load(finfo, head, &size, &count);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  free(list);
+  return list ? size : 0;
+}
 
-      // Truncate the file
-      truncate_os(fd, ptr);
-      finfo->medium_size = ptr;
+// Reads or writes a range of a chained blob, extent by extent
+int64_t _palloc_chain_io(struct palloc_fd_info *finfo, PALLOC_OFFSET head, PALLOC_OFFSET offset, char *buf, PALLOC_SIZE count, int write) {
+  PALLOC_OFFSET *list;
+  PALLOC_SIZE   i, size, extents, chunk, done = 0;
+  int64_t       n;
+
+  list = _palloc_chain_load(finfo, head, &size, &extents);
+  if (!list) return -1;
+  if (offset >= size) count = 0;
+  count = MIN(count, size - MIN(offset, size));
+
+  for(i = 0; (i < extents) && (done < count); i++) {
+    if (offset >= list[(i*2)+1]) {
+      offset -= list[(i*2)+1];
+      continue;
+    }
+    chunk = MIN(count - done, list[(i*2)+1] - offset);
+    _palloc_seek(finfo, list[i*2] + offset, SEEK_SET);
+    n = write ? _palloc_write(finfo, buf + done, chunk) : _palloc_read(finfo, buf + done, chunk);
+    if (n != chunk) {
+      free(list);
+      return -1;
     }
+    done  += chunk;
+    offset = 0;
   }
 
-  return PALLOC_OK;
+  free(list);
+  return done;
 }
 
-PALLOC_SIZE palloc_size(PALLOC_FD fd, PALLOC_OFFSET ptr) {
-  return _palloc_size(fd, ptr - sizeof(PALLOC_SIZE));
+int64_t palloc_chain_read(PALLOC_FD fd, PALLOC_OFFSET head, PALLOC_OFFSET offset, void *buf, PALLOC_SIZE count) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return -1;
+  int64_t result = _palloc_chain_io(finfo, head, offset, buf, count, 0);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return result;
 }
 
-PALLOC_OFFSET palloc_next(PALLOC_FD fd, PALLOC_OFFSET ptr) {
+int64_t palloc_chain_write(PALLOC_FD fd, PALLOC_OFFSET head, PALLOC_OFFSET offset, const void *buf, PALLOC_SIZE count) {
   struct palloc_fd_info *finfo = _palloc_info(fd);
-  PALLOC_SIZE marker;
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) return -1;
+  int64_t result = _palloc_chain_io(finfo, head, offset, (char *)buf, count, 1);
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  return result;
+}
 
-  // Easy resolve
-  if (ptr >= finfo->medium_size) return 0;
+PALLOC_RESPONSE pfree_chain(PALLOC_FD fd, PALLOC_OFFSET head) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_RESPONSE result = PALLOC_ERR;
 
-  // Handle first
-  if (!ptr) {
-    ptr = finfo->header_size;
-    seek_os(fd, ptr, SEEK_SET);
-    if (read_os(fd, &marker, sizeof(marker)) != sizeof(marker)) return 0;
-    marker = PALLOC_BETOH_SIZE(marker);
-    if (!(marker & PALLOC_MARKER_FREE)) return ptr + sizeof(marker);
+  // Only chain heads, pfree handles those as well
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  if ((_palloc_marker(finfo, head - sizeof(PALLOC_SIZE)) & (PALLOC_MARKER_CHAIN | PALLOC_MARKER_HIDDEN)) == PALLOC_MARKER_CHAIN) {
+    result = _pfree(finfo, head);
+  }
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return result;
+}
 
-  // Convert pointer to internal usage
-  } else {
-    ptr -= sizeof(PALLOC_SIZE);
+// Shares a medium's extents with a new file on filesystems with reflinks,
+// which only copies metadata
+int _palloc_snapshot_clone(struct palloc_fd_info *finfo, int dst) {
+#if defined(PALLOC_HAVE_FICLONE)
+  if (finfo->backend == &palloc_backend_os) {
+    return ioctl(dst, FICLONE, (int)(intptr_t)finfo->udata);
   }
+#endif
+  return -1;
+}
 
-  // Read the marker of the given block
-  seek_os(fd, ptr, SEEK_SET);
-  if (read_os(fd, &marker, sizeof(marker)) != sizeof(marker)) return 0;
-  marker = PALLOC_BETOH_SIZE(marker);
+// Copies a medium between os descriptors without passing it through
+// userspace. A medium shrinking during the copy ends it early.
+int _palloc_snapshot_os(int src, int dst, PALLOC_SIZE size) {
+#if defined(PALLOC_HAVE_COPY_FILE_RANGE)
+  loff_t  in = 0, out = 0;
+  ssize_t n = 0;
+  while((PALLOC_SIZE)in < size) {
+    n = copy_file_range(src, &in, dst, &out, size - in, 0);
+    if (n <= 0) break;
+  }
+  if (n >= 0) return 0;
+#endif
+  return -1;
+}
 
-  // Skip the first one
-  ptr = ptr + (sizeof(PALLOC_SIZE) * 2) + (marker & (~PALLOC_MARKER_FREE));
-  while(1) {
-    if (ptr >= finfo->medium_size) return 0;
-    seek_os(fd, ptr, SEEK_SET);
-    if (read_os(fd, &marker, sizeof(marker)) != sizeof(marker)) return 0;
-    marker = PALLOC_BETOH_SIZE(marker);
-    if (!(marker & PALLOC_MARKER_FREE)) return ptr + sizeof(marker);
-    ptr += (sizeof(marker)*2) + (marker & (~PALLOC_MARKER_FREE));
+// Copies a medium through it's backend, for when the kernel can't
+int _palloc_snapshot_stream(struct palloc_fd_info *finfo, int dst, PALLOC_SIZE size) {
+  char        *buf = malloc(PALLOC_STREAM_SIZE);
+  PALLOC_SIZE pos  = 0;
+  int64_t     n = 0, w = 0;
+
+  if (!buf) return -1;
+  _palloc_seek(finfo, 0, SEEK_SET);
+  seek_os(dst, 0, SEEK_SET);
+  while(pos < size) {
+    n = _palloc_read(finfo, buf, MIN(size - pos, PALLOC_STREAM_SIZE));
+    if (n <= 0) break;
+    for(w = 0; w < n;) {
+      int64_t written = write_os(dst, buf + w, n - w);
+      if (written <= 0) break;
+      w += written;
+    }
+    if (w < n) break;
+    pos += n;
   }
+  free(buf);
+  return ((n >= 0) && (w >= n)) ? 0 : -1;
+}
 
-  return 0;
+// Links the blocks other descriptors still had queued as deferred frees
+// into the free list of the copy
+int _palloc_snapshot_repair(const char *filename, PALLOC_FLAGS flags) {
+  PALLOC_FD       fd = palloc_open(filename, flags);
+  PALLOC_RESPONSE result;
+  if (!fd) return -1;
+  result = palloc_repair(fd);
+  palloc_close(fd);
+  return (result == PALLOC_OK) ? 0 : -1;
+}
+
+PALLOC_RESPONSE palloc_snapshot(PALLOC_FD fd, const char *filename) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  PALLOC_SIZE size;
+  int         err = -1;
+
+  int dst = open_os(filename, O_WRONLY | O_CREAT | O_TRUNC, OPENMODE);
+  if (dst < 0) {
+    perror("palloc_snapshot::open");
+    return PALLOC_ERR;
+  }
+
+  // Allocating and freeing only waits for our flush, or for a reflink
+  // which is a single point in time by itself
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) {
+    close_os(dst);
+    return PALLOC_ERR;
+  }
+  _palloc_flush(finfo);
+  err = _palloc_snapshot_clone(finfo, dst);
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  if (!err) {
+    close_os(dst);
+    return PALLOC_OK;
+  }
+
+  // Other copies hold the read lock throughout, as allocating or freeing
+  // halfway would tear the markers in the copy. Readers still get through.
+  if (_palloc_lock(finfo, PALLOC_LOCK_READ)) {
+    close_os(dst);
+    return PALLOC_ERR;
+  }
+  size = _palloc_seek(finfo, 0, SEEK_END);
+  if (finfo->backend == &palloc_backend_os) {
+    err = _palloc_snapshot_os((int)(intptr_t)finfo->udata, dst, size);
+  }
+  if (err) {
+    err = _palloc_snapshot_stream(finfo, dst, size);
+  }
+  _palloc_unlock(finfo, PALLOC_LOCK_READ);
+  close_os(dst);
+  if (!err) {
+    err = _palloc_snapshot_repair(filename, finfo->flags & (~PALLOC_SYNC));
+  }
+
+  if (err) perror("palloc_snapshot::copy");
+  return err ? PALLOC_ERR : PALLOC_OK;
+}
+
+PALLOC_RESPONSE palloc_record(PALLOC_FD fd, const char *filename) {
+  struct palloc_fd_info *finfo = _palloc_info(fd);
+  uint32_t flags;
+  uint64_t size;
+
+  if (_palloc_lock(finfo, PALLOC_LOCK_WRITE)) return PALLOC_ERR;
+  _palloc_record_stop(finfo);
+  if (!filename) {
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_OK;
+  }
+
+  finfo->record_fd = open_os(filename, O_WRONLY | O_CREAT | O_TRUNC, OPENMODE);
+  if (finfo->record_fd < 0) {
+    perror("palloc_record::open");
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_ERR;
+  }
+  finfo->record_buf = malloc(PALLOC_RECORD_SIZE);
+  if (!finfo->record_buf) {
+    perror("palloc_record::malloc");
+    close_os(finfo->record_fd);
+    _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+    return PALLOC_ERR;
+  }
+
+  // Header carries what's needed to re-create the medium, as it is now
+  flags = PALLOC_HTOBE_FLAGS(finfo->flags);
+  size  = PALLOC_HTOBE_SIZE(finfo->medium_size);
+  memcpy(finfo->record_buf, PALLOC_RECORD_MAGIC, 4);
+  memcpy(finfo->record_buf + 4, &flags, sizeof(flags));
+  memcpy(finfo->record_buf + 8, &size, sizeof(size));
+  finfo->record_len  = 4 + sizeof(flags) + sizeof(size);
+  finfo->record_time = _palloc_record_clock();
+
+  _palloc_unlock(finfo, PALLOC_LOCK_WRITE);
+  return PALLOC_OK;
+}
+
+#ifdef PALLOC_TRACE
+
+void palloc_trace_hook(void (*hook)(const struct palloc_trace *event, void *udata), void *udata) {
+  _palloc_trace_hook  = hook;
+  _palloc_trace_udata = udata;
 }
 
+void palloc_trace_histogram(int op, uint64_t *buckets) {
+  if ((op < 0) || (op >= PALLOC_TRACE_OPS)) {
+    memset(buckets, 0, sizeof(uint64_t) * PALLOC_TRACE_BUCKETS);
+    return;
+  }
+  memcpy(buckets, _palloc_trace_buckets[op], sizeof(uint64_t) * PALLOC_TRACE_BUCKETS);
+}
+
+void palloc_trace_reset() {
+  memset(_palloc_trace_buckets, 0, sizeof(_palloc_trace_buckets));
+}
+
+#endif
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -49,6 +49,32 @@
 /// - [finwo/assert](https://github.com/finwo/assert.h)
 /// - [finwo/canonical-path](https://github.com/finwo/canonical-path.c)
 /// - [finwo/endian](https://github.com/finwo/endian.h)
+///
+/// C++
+/// ---
+///
+/// A header-only C++ layer is exported as `finwo/palloc.hpp`, holding RAII
+/// types for mediums and blobs, range-for iteration over a medium's blobs
+/// and, for C++17, a `std::pmr::memory_resource` allocating from a
+/// memory-mapped non-dynamic medium.
+///
+/// ```cpp
+/// finwo::palloc::medium db("path/to/file.db", PALLOC_DEFAULT | PALLOC_DYNAMIC);
+/// db.init(PALLOC_DEFAULT | PALLOC_DYNAMIC);
+///
+/// // Freed when going out of scope, unless released
+/// finwo::palloc::blob blob = db.alloc(1024);
+/// blob.write("hello", 6);
+/// blob.release();
+///
+/// for (PALLOC_OFFSET ptr : db) {
+///   // ...
+/// }
+///
+/// // Containers living on the medium
+/// finwo::palloc::mapped_resource resource("path/to/fixed.db", 1024*1024);
+/// std::pmr::vector<int> numbers(&resource);
+/// ```
 
 #ifdef __cplusplus
 extern "C" {
@@ -97,6 +123,60 @@ extern "C" {
 ///>
 /// </details>
 
+/// <details>
+///   <summary>PALLOC_SHARED</summary>
+///
+///   Indicates a storage medium to be initialized for use by multiple
+///   processes at once. The header then carries a generation counter and the
+///   first free block, and every operation holds a (posix record) lock on
+///   the header, shared for reading and exclusive for allocating or freeing.
+///   Writers keep the generation odd while modifying the medium, which lets
+///   palloc_next skip the lock when the generation is even, matches what
+///   was last seen and is unchanged after the step. Operations fail (0,
+///   -1 or PALLOC_ERR) when the lock can't be taken, and a read lock is
+///   never upgraded to a write lock.
+///<C
+#define PALLOC_SHARED 4
+///>
+/// </details>
+
+/// <details>
+///   <summary>PALLOC_CHECKSUM</summary>
+///
+///   Indicates a storage medium to be initialized with a crc32c check slot in
+///   every block, covering the block's markers and, once sealed using
+///   palloc_seal, the blob's data. Uses the cpu's crc32 instructions when
+///   available (SSE4.2 or ARMv8). The check slot is not counted in the size
+///   reported by palloc_size.
+///<C
+#define PALLOC_CHECKSUM 8
+///>
+/// </details>
+
+/// <details>
+///   <summary>PALLOC_HANDLES</summary>
+///
+///   Indicates a storage medium to be initialized with a handle table, which
+///   gives blobs allocated using palloc_handle a stable reference while the
+///   library is free to relocate them. The table is stored as an internal
+///   blob, hidden from iteration, and kept in memory for lookups.
+///<C
+#define PALLOC_HANDLES 16
+///>
+/// </details>
+
+/// <details>
+///   <summary>PALLOC_COMPRESS</summary>
+///
+///   Indicates a storage medium to be initialized with compression, making
+///   palloc_store compress blobs using the built-in lz4-style codec. Blobs
+///   are only stored compressed when that saves space, and read back using
+///   palloc_load. Iterating does not decompress anything.
+///<C
+#define PALLOC_COMPRESS 32
+///>
+/// </details>
+
 /// <details>
 ///   <summary>PALLOC_EXTENDED</summary>
 ///
@@ -107,6 +187,21 @@ extern "C" {
 ///>
 /// </details>
 
+///
+/// ### Definitions - Locks
+///
+
+/// <details>
+///   <summary>PALLOC_LOCK_*</summary>
+///
+///   Lock types passed to a backend's lock method
+///<C
+#define PALLOC_LOCK_UNLOCK 0
+#define PALLOC_LOCK_READ   1
+#define PALLOC_LOCK_WRITE  2
+///>
+/// </details>
+
 ///
 /// ### Definitions - Types
 ///
@@ -120,6 +215,18 @@ extern "C" {
 ///>
 /// </details>
 
+/// <details>
+///   <summary>PALLOC_FD_VIRTUAL</summary>
+///
+///   Start of the range of descriptors handed out for mediums not backed by
+///   an os descriptor, like palloc_open_memory. These are positive, so the
+///   usual fd &lt; 0 error check holds, and far above what the os hands out.
+///   Methods opening a medium return 0 on error.
+///<C
+#define PALLOC_FD_VIRTUAL 0x40000000
+///>
+/// </details>
+
 /// <details>
 ///   <summary>PALLOC_FLAGS</summary>
 ///
@@ -149,6 +256,16 @@ extern "C" {
 #endif
 /// </details>
 
+/// <details>
+///   <summary>PALLOC_HANDLE</summary>
+///
+///   A stable reference to a blob on a medium initialized with
+///   PALLOC_HANDLES, 0 meaning no blob
+///<C
+#define PALLOC_HANDLE uint64_t
+///>
+/// </details>
+
 /// <details>
 ///   <summary>PALLOC_SIZE</summary>
 ///
@@ -160,6 +277,108 @@ extern "C" {
 #endif
 /// </details>
 
+/// <details>
+///   <summary>struct palloc_backend</summary>
+///
+///   Set of storage operations palloc performs on a medium. Each operation
+///   receives the udata pointer the medium was opened with and should behave
+///   like it's posix counterpart (lseek, read, write, ftruncate, close),
+///   including the file growing when writing past it's end. The lock method
+///   blocks until the given range is locked as requested (fcntl's F_SETLKW)
+///   and may be NULL for backends that are never shared between processes.
+///   The optional punch method deallocates the given range while keeping the
+///   medium's size, reading back as zeroes (FALLOC_FL_PUNCH_HOLE).
+///<C
+struct palloc_backend {
+  int64_t (*seek    )(void *udata, int64_t offset, int whence);
+  int64_t (*read    )(void *udata, void *buf, PALLOC_SIZE count);
+  int64_t (*write   )(void *udata, const void *buf, PALLOC_SIZE count);
+  int     (*truncate)(void *udata, PALLOC_OFFSET length);
+  int     (*close   )(void *udata);
+  int     (*lock    )(void *udata, PALLOC_OFFSET offset, PALLOC_SIZE length, int type);
+  int     (*punch   )(void *udata, PALLOC_OFFSET offset, PALLOC_SIZE length);
+};
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_backend_os</summary>
+///
+///   The backend used for regular file descriptors, with the descriptor
+///   itself cast to the udata pointer. Useful as the lower layer when
+///   wrapping the storage in your own (caching) backend.
+///<C
+extern const struct palloc_backend palloc_backend_os;
+///>
+/// </details>
+
+/// <details>
+///   <summary>PALLOC_TRACE_*</summary>
+///
+///   Operations reported when the library is compiled with PALLOC_TRACE
+///   defined, and the amount of log2 latency buckets kept per operation.
+///   Without it, the tracepoints compile away entirely.
+///<C
+#ifdef PALLOC_TRACE
+#define PALLOC_TRACE_PALLOC  0
+#define PALLOC_TRACE_PFREE   1
+#define PALLOC_TRACE_MERGE   2
+#define PALLOC_TRACE_NEXT    3
+#define PALLOC_TRACE_INIT    4
+#define PALLOC_TRACE_OPS     5
+#define PALLOC_TRACE_BUCKETS 64
+#endif
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct palloc_trace</summary>
+///
+///   Tracepoint event, passed to the hook at the start (done = 0) and end
+///   (done = 1) of an operation. Ptr and size are the operation's input at
+///   the start and it's outcome at the end:
+///
+///   - palloc: the requested size, and the returned pointer
+///   - pfree: the pointer being freed
+///   - merge: the left and right free block, and the merged block's size
+///     (0 if not merged)
+///   - next: the given and returned pointer
+///   - init: the medium's first free block and size, once scanned
+///
+///   Visited counts the free extents and blocks looked at, elapsed the
+///   nanoseconds spent, both only filled at the end.
+///<C
+#ifdef PALLOC_TRACE
+struct palloc_trace {
+  int           op;
+  int           done;
+  PALLOC_FD     fd;
+  PALLOC_OFFSET ptr;
+  PALLOC_SIZE   size;
+  PALLOC_SIZE   visited;
+  uint64_t      elapsed;
+};
+#endif
+///>
+/// </details>
+
+/// <details>
+///   <summary>struct palloc_stats</summary>
+///
+///   Free space of a medium as reported by palloc_available. Sizes are usable
+///   data sizes, so largest is the largest blob palloc can place without
+///   growing the medium. Fragmentation is the share of free space outside
+///   the largest free block, from 0 for a single free block towards 1.
+///<C
+struct palloc_stats {
+  PALLOC_SIZE free;
+  PALLOC_SIZE largest;
+  PALLOC_SIZE blocks;
+  double      fragmentation;
+};
+///>
+/// </details>
+
 ///
 /// ### Definitions - Responses
 ///
@@ -190,12 +409,45 @@ extern "C" {
 ///   <summary>palloc_open(filename, flags)</summary>
 ///
 ///   Opens a palloc medium and returns it as a file descriptor both palloc and
-///   the user can use.
+///   the user can use, or 0 on error.
 ///<C
 PALLOC_FD palloc_open(const char *filename, PALLOC_FLAGS flags);
 ///>
 /// </details>
 
+/// <details>
+///   <summary>palloc_open_backend(backend, udata)</summary>
+///
+///   Opens a medium served by a user-supplied backend and returns a virtual
+///   descriptor (see PALLOC_FD_VIRTUAL) to use with the rest of the palloc
+///   methods. The backend's close method is called when the descriptor is
+///   closed. Flags are given to palloc_init, as the backend does the opening.
+///<C
+PALLOC_FD palloc_open_backend(const struct palloc_backend *backend, void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_open_memory()</summary>
+///
+///   Opens an empty medium living in an in-process memory buffer, which is
+///   discarded when the descriptor is closed.
+///<C
+PALLOC_FD palloc_open_memory();
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_open_memfd(name)</summary>
+///
+///   Opens an empty anonymous memory-backed file (memfd) as medium, which can
+///   be shared with child processes. Falls back to palloc_open_memory on
+///   platforms without memfd support.
+///<C
+PALLOC_FD palloc_open_memfd(const char *name);
+///>
+/// </details>
+
 /// <details>
 ///   <summary>palloc_init(fd, flags)</summary>
 ///
@@ -226,6 +478,50 @@ PALLOC_OFFSET palloc(PALLOC_FD fd, PALLOC_SIZE size);
 ///>
 /// </details>
 
+/// <details>
+///   <summary>palloc_hint(fd, size, near)</summary>
+///
+///   Like palloc, but takes the fitting free block closest to offset near
+///   instead of the first one in the medium, keeping related blobs together.
+///   Hinting short- and long-lived blobs towards different offsets keeps
+///   them in separate zones where free space allows. A near of 0 behaves as
+///   palloc.
+///<C
+PALLOC_OFFSET palloc_hint(PALLOC_FD fd, PALLOC_SIZE size, PALLOC_OFFSET near);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_available(fd, stats)</summary>
+///
+///   Fills stats with the free space of the medium, holding only a read lock
+///   on shared mediums. Deferred frees count as free blocks of their own
+///   without being flushed, so stats may show them as fragmented where
+///   flushing would merge them. Answered from the in-memory free extents, so
+///   only the first call after opening the medium reads it's free list.
+///<C
+PALLOC_RESPONSE palloc_available(PALLOC_FD fd, struct palloc_stats *stats);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_reserve(fd, size)</summary>
+///
+///   Grows to fit only: makes sure a single free block of at least size bytes
+///   exists, growing dynamic mediums up-front if needed. Others return
+///   PALLOC_ERR when the space is not there. Nothing is held against other
+///   allocations, and a dynamic medium gives the space back as soon as the
+///   blob before it is freed.
+///
+///   Size is not adjusted for per-blob overhead. A batch of blobs is only
+///   guaranteed to fit when size counts every blob as it's size, rounded up
+///   to at least 16 bytes, plus 16 bytes of markers and, on checksummed
+///   mediums, an 8-byte check slot.
+///<C
+PALLOC_RESPONSE palloc_reserve(PALLOC_FD fd, PALLOC_SIZE size);
+///>
+/// </details>
+
 /// <details>
 ///   <summary>pfree(fd,ptr)</summary>
 ///
@@ -237,16 +533,150 @@ PALLOC_RESPONSE pfree(PALLOC_FD fd, PALLOC_OFFSET ptr);
 ///>
 /// </details>
 
+/// <details>
+///   <summary>palloc_defer(fd, enabled)</summary>
+///
+///   Enables or disables deferred freeing for the descriptor. While enabled,
+///   pfree only marks the blob pending and queues it in memory, leaving the
+///   free list walk, linking and merging to palloc_flush. Pending blobs are
+///   hidden from iteration and allocation, also for other descriptors.
+///   Disabling or closing the descriptor flushes the queue, as does palloc
+///   when it can't find a fitting free block. After a crash, palloc_repair
+///   links blocks that were still queued.
+///<C
+PALLOC_RESPONSE palloc_defer(PALLOC_FD fd, int enabled);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_flush(fd)</summary>
+///
+///   Links all queued deferred frees into the free list in a single sweep
+///   ordered by offset, merging consecutive free blocks along the way.
+///<C
+PALLOC_RESPONSE palloc_flush(PALLOC_FD fd);
+///>
+/// </details>
+
 /// <details>
 ///   <summary>palloc_size(fd,ptr)</summary>
 ///
 ///   Returns the real size of the data section of the allocated blob pointed
-///   to by ptr, not the originally requested size.
+///   to by ptr, not the originally requested size. This is what palloc_read
+///   and palloc_write may access, which for compressed blobs is the stored
+///   form of the data. Use palloc_logical_size for what palloc_load returns.
 ///<C
 PALLOC_SIZE palloc_size(PALLOC_FD fd, PALLOC_OFFSET ptr);
 ///>
 /// </details>
 
+/// <details>
+///   <summary>palloc_logical_size(fd,ptr)</summary>
+///
+///   Returns the size of the data palloc_load returns for the blob pointed
+///   to by ptr. That's the logical size for compressed blobs, and the same
+///   as palloc_size for others.
+///<C
+PALLOC_SIZE palloc_logical_size(PALLOC_FD fd, PALLOC_OFFSET ptr);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_read(fd, ptr, buf, count)</summary>
+///
+///   Reads count bytes at offset ptr of the medium into buf, going through
+///   the medium's backend. Returns the amount of bytes read or -1 on error.
+///<C
+int64_t palloc_read(PALLOC_FD fd, PALLOC_OFFSET ptr, void *buf, PALLOC_SIZE count);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_write(fd, ptr, buf, count)</summary>
+///
+///   Writes count bytes from buf at offset ptr of the medium, going through
+///   the medium's backend. Returns the amount of bytes written or -1 on error.
+///<C
+int64_t palloc_write(PALLOC_FD fd, PALLOC_OFFSET ptr, const void *buf, PALLOC_SIZE count);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_seal(fd, ptr)</summary>
+///
+///   Stores a checksum of the current data of the blob pointed to by ptr, to
+///   be checked by palloc_verify. Call after writing the blob's data, as the
+///   library does not see those writes. Only available on mediums
+///   initialized with PALLOC_CHECKSUM.
+///<C
+PALLOC_RESPONSE palloc_seal(PALLOC_FD fd, PALLOC_OFFSET ptr);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_store(fd, data, size)</summary>
+///
+///   Allocates a blob holding the given data and writes it in one go. On
+///   mediums initialized with PALLOC_COMPRESS the data is compressed when
+///   that makes it smaller. Returns a pointer to the blob's data section, to
+///   be read using palloc_load, or 0 on failure. Compressed blobs must not be
+///   changed using palloc_write, which would corrupt the stored form.
+///<C
+PALLOC_OFFSET palloc_store(PALLOC_FD fd, const void *data, PALLOC_SIZE size);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_load(fd, ptr, buf, count)</summary>
+///
+///   Reads up to count bytes of the blob pointed to by ptr into buf,
+///   decompressing compressed blobs. Returns the amount of bytes read or -1
+///   on error or corrupt data.
+///<C
+int64_t palloc_load(PALLOC_FD fd, PALLOC_OFFSET ptr, void *buf, PALLOC_SIZE count);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_verify(fd, bad, udata)</summary>
+///
+///   Checks the whole medium in a single buffered sequential pass and returns
+///   the amount of bad ranges found. Each bad range, as outer offsets of the
+///   affected blocks, is passed to bad if given. A broken marker makes the
+///   remainder of the medium unreachable, so is reported as a single range
+///   up to the end of the medium.
+///<C
+PALLOC_SIZE palloc_verify(PALLOC_FD fd, void (*bad)(PALLOC_FD fd, PALLOC_OFFSET start, PALLOC_OFFSET end, void *udata), void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_repair(fd)</summary>
+///
+///   Rebuilds the free list of a medium, for example after a crash in the
+///   middle of an allocation or free. Validates every block's marker pair in
+///   a single buffered sequential pass, coalesces adjacent free blocks and
+///   rewrites all free list pointers in a single ascending write pass.
+///   Anything following a broken marker is unreachable, and is truncated on
+///   dynamic mediums or marked free otherwise.
+///<C
+PALLOC_RESPONSE palloc_repair(PALLOC_FD fd);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_trim(fd, threshold)</summary>
+///
+///   Hands the interior of every free block of at least threshold bytes back
+///   to the filesystem by punching a hole in it. Only the pages holding the
+///   block's markers and free list pointers stay allocated, and allocating
+///   from a punched block never reads it's data back. Returns PALLOC_ERR if
+///   the medium's backend can not punch holes.
+///<C
+PALLOC_RESPONSE palloc_trim(PALLOC_FD fd, PALLOC_SIZE threshold);
+///>
+/// </details>
+
 /// <details>
 ///   <summary>palloc_next(pt, ptr)</summary>
 ///
@@ -258,6 +688,265 @@ PALLOC_OFFSET palloc_next(PALLOC_FD fd, PALLOC_OFFSET ptr);
 ///>
 /// </details>
 
+/// <details>
+///   <summary>palloc_next_in(fd, ptr, start, end)</summary>
+///
+///   Like palloc_next, but bounded to blobs with their data section starting
+///   within [start, end). With ptr 0, returns start itself if it's an
+///   allocated blob or the first one after it. Start must be 0 or an offset
+///   to a data section, end of 0 means the end of the medium. A start inside
+///   the header or not on a block, judged by the markers around it, returns
+///   0. Iteration stops as soon as it reaches end, without reading the
+///   blocks beyond.
+///<C
+PALLOC_OFFSET palloc_next_in(PALLOC_FD fd, PALLOC_OFFSET ptr, PALLOC_OFFSET start, PALLOC_OFFSET end);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_prev(fd, ptr)</summary>
+///
+///   Returns an offset to the data section of the previous allocated blob
+///   based on the offset to a data section indicated by ptr, or 0 if no
+///   previous allocated blob exists. With ptr 0, returns the last allocated
+///   blob in the medium, using the trailing size marker of every block to
+///   walk backwards.
+///<C
+PALLOC_OFFSET palloc_prev(PALLOC_FD fd, PALLOC_OFFSET ptr);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_bulk(fd, count, sizes, data, ptrs)</summary>
+///
+///   Allocates count blobs with the given sizes and writes their data in one
+///   go. On dynamic mediums the blobs are laid out back-to-back at the end of
+///   the medium, streaming markers and data through a single buffer. Other
+///   mediums allocate every blob as palloc would. Data may be NULL, as may
+///   any of it's entries, to leave blobs zeroed. The offsets of the blobs are
+///   stored in ptrs if given. Blobs on checksummed mediums come out sealed.
+///<C
+PALLOC_RESPONSE palloc_bulk(PALLOC_FD fd, PALLOC_SIZE count, const PALLOC_SIZE *sizes, const void * const *data, PALLOC_OFFSET *ptrs);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_export(fd, write, udata)</summary>
+///
+///   Streams the data of all allocated blobs, in medium order, to write in a
+///   portable format which skips free space, markers and checksums. Write is
+///   called with large buffers and must return the amount of bytes written.
+///   See the export stream structure below.
+///<C
+PALLOC_RESPONSE palloc_export(PALLOC_FD fd, int64_t (*write)(const void *buf, PALLOC_SIZE count, void *udata), void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_import(fd, read, udata)</summary>
+///
+///   Bulk-loads all blobs from an export stream into an initialized medium,
+///   as palloc_bulk would. Read must return the amount of bytes read, 0 at
+///   the end of the stream or -1 on error.
+///<C
+PALLOC_RESPONSE palloc_import(PALLOC_FD fd, int64_t (*read)(void *buf, PALLOC_SIZE count, void *udata), void *udata);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_handle(fd, size)</summary>
+///
+///   Allocates a new blob like palloc, but returns a handle to it instead of
+///   it's offset, or 0 on failure. Use palloc_resolve to get the blob's
+///   current offset. Only available on mediums initialized with
+///   PALLOC_HANDLES.
+///<C
+PALLOC_HANDLE palloc_handle(PALLOC_FD fd, PALLOC_SIZE size);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_resolve(fd, handle)</summary>
+///
+///   Returns the current offset to the data section of the blob behind
+///   handle, or 0 if the handle is not in use. A single lookup in the
+///   in-memory copy of the handle table. Offsets are only valid until the
+///   next palloc_move or palloc_compact.
+///<C
+PALLOC_OFFSET palloc_resolve(PALLOC_FD fd, PALLOC_HANDLE handle);
+///>
+/// </details>
+
+/// <details>
+///   <summary>pfree_handle(fd, handle)</summary>
+///
+///   Frees the blob behind handle and releases the handle for re-use
+///<C
+PALLOC_RESPONSE pfree_handle(PALLOC_FD fd, PALLOC_HANDLE handle);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_move(fd, handle, near)</summary>
+///
+///   Relocates the blob behind handle to the fitting free block closest to
+///   near, as palloc_hint would place it, keeping it's data and seal. Returns
+///   the blob's new offset, or 0 if it could not be moved.
+///<C
+PALLOC_OFFSET palloc_move(PALLOC_FD fd, PALLOC_HANDLE handle, PALLOC_OFFSET near);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_compact(fd)</summary>
+///
+///   Moves every blob behind a handle into the first free block before it
+///   that fits, packing blobs towards the start of the medium. Dynamic
+///   mediums shrink as their end becomes free. Returns the amount of blobs
+///   moved.
+///<C
+PALLOC_SIZE palloc_compact(PALLOC_FD fd);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_chain(fd, size)</summary>
+///
+///   Allocates a large blob of size bytes stitched together from several free
+///   blocks, for when no single free block is large enough. Free blocks are
+///   used in ascending order and dynamic mediums append whatever is left.
+///   Returns an offset to the chain's head, a blob flagged as such holding
+///   the list of extents, which are internal blobs hidden from iteration.
+///   Iteration returns the head, use the palloc_chain_* methods to access
+///   it's data. Freeing the head using pfree frees the extents as well.
+///   Export writes a chain as it's logical data, which import turns into a
+///   regular blob.
+///<C
+PALLOC_OFFSET palloc_chain(PALLOC_FD fd, PALLOC_SIZE size);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_chain_size(fd, head)</summary>
+///
+///   Returns the size a chained blob was allocated with, or 0 if head is
+///   not a chain head, telling chains apart during iteration.
+///<C
+PALLOC_SIZE palloc_chain_size(PALLOC_FD fd, PALLOC_OFFSET head);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_chain_read(fd, head, offset, buf, count)</summary>
+///
+///   Reads count bytes from offset within a chained blob into buf, crossing
+///   extents as needed. Returns the amount of bytes read, which is less than
+///   count at the end of the blob, or -1 on error.
+///<C
+int64_t palloc_chain_read(PALLOC_FD fd, PALLOC_OFFSET head, PALLOC_OFFSET offset, void *buf, PALLOC_SIZE count);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_chain_write(fd, head, offset, buf, count)</summary>
+///
+///   Writes count bytes from buf at offset within a chained blob, crossing
+///   extents as needed. Returns the amount of bytes written, which is less
+///   than count at the end of the blob, or -1 on error.
+///<C
+int64_t palloc_chain_write(PALLOC_FD fd, PALLOC_OFFSET head, PALLOC_OFFSET offset, const void *buf, PALLOC_SIZE count);
+///>
+/// </details>
+
+/// <details>
+///   <summary>pfree_chain(fd, head)</summary>
+///
+///   Frees all extents of a chained blob and it's head, like pfree does.
+///   Returns PALLOC_ERR if head is not a chain head.
+///<C
+PALLOC_RESPONSE pfree_chain(PALLOC_FD fd, PALLOC_OFFSET head);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_snapshot(fd, filename)</summary>
+///
+///   Copies the medium into a new file, which can be opened as a medium of
+///   it's own. Deferred frees are flushed first. On Linux filesystems with
+///   reflinks (FICLONE), the copy only shares metadata and is taken while
+///   allocating and freeing waits, giving the free list at a single point
+///   in time.
+///
+///   Otherwise the medium is copied holding a read lock, using
+///   copy_file_range on Linux or a buffer on other platforms and backends.
+///   Allocating and freeing waits for the copy, while readers continue.
+///   Blocks other descriptors still have queued as deferred frees are
+///   linked into the copy's free list by palloc_repair afterwards.
+///
+///   In neither case is blob data guarded, as palloc_write holds no locks,
+///   and without PALLOC_SHARED no locks are taken at all. Writers elsewhere
+///   must pause for the snapshot to hold consistent data.
+///<C
+PALLOC_RESPONSE palloc_snapshot(PALLOC_FD fd, const char *filename);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_record(fd, filename)</summary>
+///
+///   Starts recording every allocation and free on the medium to the given
+///   file, replacing it, for replay by palloc-replay. That includes those
+///   made by palloc_store, palloc_bulk, palloc_import, handles, chains and
+///   compaction, as well as the library's own internal blobs. Failed
+///   allocations are not recorded. Passing NULL stops recording, as does
+///   closing the medium. Records are buffered, so the file is only complete
+///   once recording stops.
+///<C
+PALLOC_RESPONSE palloc_record(PALLOC_FD fd, const char *filename);
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_trace_hook(hook, udata)</summary>
+///
+///   Registers a function to be called on every tracepoint, replacing any
+///   previous one, or removes it when given NULL. Latency histograms are
+///   kept regardless of a hook being registered. Only available when
+///   compiled with PALLOC_TRACE.
+///<C
+#ifdef PALLOC_TRACE
+void palloc_trace_hook(void (*hook)(const struct palloc_trace *event, void *udata), void *udata);
+#endif
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_trace_histogram(op, buckets)</summary>
+///
+///   Copies the latency histogram of op into buckets, which must hold
+///   PALLOC_TRACE_BUCKETS counters. Bucket n counts the operations taking
+///   from 2^n up to 2^(n+1) nanoseconds, bucket 0 including instant ones.
+///   Histograms, like the hook, are process-global across all descriptors
+///   and updated without synchronization, so counts from threads tracing
+///   at the same time may be lost.
+///<C
+#ifdef PALLOC_TRACE
+void palloc_trace_histogram(int op, uint64_t *buckets);
+#endif
+///>
+/// </details>
+
+/// <details>
+///   <summary>palloc_trace_reset()</summary>
+///
+///   Clears the latency histograms of all operations
+///<C
+#ifdef PALLOC_TRACE
+void palloc_trace_reset();
+#endif
+///>
+/// </details>
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -269,12 +958,33 @@ PALLOC_OFFSET palloc_next(PALLOC_FD fd, PALLOC_OFFSET ptr);
 /// - header
 ///     - 4B header "PBA\0"
 ///     - uint16_t  flags
+///     - shared mediums only:
+///         - 8B generation, odd while an allocation or free is being
+///           written and even once it is published
+///         - 8B pointer to the first free block
+///     - mediums with handles only:
+///         - 8B pointer to the handle table's data (0 = no table yet)
 /// - blobs
-///     - 8B free + size
+///     - 8B free + internal + compressed + chain + size
 /// - size indicator: data only, excludes size indicator itself
 /// - free flag:
 ///     - 1 = free
 ///     - 0 = occupied
+/// - internal flag, for occupied blocks used by the library itself:
+///     - 1 = internal, hidden from iteration
+///     - 0 = regular blob
+/// - free and internal flag together: freed using palloc_defer but not yet
+///   linked into the free list, linked by palloc_repair after a crash
+/// - compressed flag, for occupied blocks stored using palloc_store:
+///     - 1 = data holds 8B logical size, 8B compressed length and the
+///       compressed data
+///     - 0 = data is stored as-is
+/// - chain flag, for occupied blocks returned by palloc_chain:
+///     - 1 = chain head, data holds 8B size, 8B extent count and per extent
+///       an 8B pointer to the internal blob's data and 8B length used
+///     - 0 = not a chain head
+/// - handle table: internal blob of 8B pointers to the data of the blob
+///   behind each handle (0 = unused), handle n being at index n-1
 /// - blob structure:
 ///     - free:
 ///         - 8B size | flag
@@ -285,4 +995,34 @@ PALLOC_OFFSET palloc_next(PALLOC_FD fd, PALLOC_OFFSET ptr);
 ///         - 8B size
 ///         - &lt;data[n]&gt;
 ///         - 8B size
+///     - checksummed mediums end every data section with a check slot:
+///         - 4B crc32c of data (0 = not sealed)
+///         - 4B crc32c of block offset + marker
+
+///
+/// Export stream structure
+/// -----------------------
+///
+/// - header
+///     - 4B header "PBX\0"
+/// - records, one per allocated blob, until the end of the stream
+///     - 8B size of the blob's data section, excluding any check slot, or
+///       the logical size of compressed and chained blobs
+///     - &lt;data[size]&gt;
 
+///
+/// Record stream structure
+/// -----------------------
+///
+/// - header
+///     - 4B header "PBR\0"
+///     - 4B flags of the medium
+///     - 8B size of the medium when recording started
+/// - records, one per operation, until the end of the stream
+///     - 1B operation, 'a' for allocations and 'f' for frees
+///     - varint nanoseconds since the previous record, or since the start
+///     - allocations only: varint requested size
+///     - varint pointer returned by the allocation or freed, only successful
+///       allocations are written
+/// - varints are unsigned leb128: 7 bits per byte, least significant first,
+///   the high bit set on all but the last byte
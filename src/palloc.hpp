@@ -0,0 +1,259 @@
+#ifndef __FINWO_PALLOC_HPP__
+#define __FINWO_PALLOC_HPP__
+
+// Header-only C++ layer around palloc.h
+//
+// - finwo::palloc::medium owns a PALLOC_FD, closing it when destroyed
+// - palloc::blob owns an allocation, freeing it when destroyed
+// - iterating a medium walks it's blobs using palloc_next
+// - palloc::mapped_resource is a std::pmr::memory_resource allocating from a
+//   memory-mapped non-dynamic medium, so containers live on the medium
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "palloc.h"
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && (__cplusplus >= 201703L) && !defined(_WIN32) && !defined(_WIN64)
+#include <memory_resource>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PALLOC_HAVE_PMR
+#endif
+#endif
+
+namespace finwo {
+namespace palloc {
+
+  // Iterates the offsets of a medium's blobs, in order of the medium
+  class iterator {
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type        = PALLOC_OFFSET;
+      using difference_type   = std::ptrdiff_t;
+      using pointer           = const PALLOC_OFFSET *;
+      using reference         = const PALLOC_OFFSET &;
+
+      iterator() : fd_(0), ptr_(0) {}
+      iterator(PALLOC_FD fd, PALLOC_OFFSET ptr) : fd_(fd), ptr_(ptr) {}
+
+      reference operator*() const { return ptr_; }
+      pointer operator->() const { return &ptr_; }
+
+      iterator &operator++() {
+        ptr_ = palloc_next(fd_, ptr_);
+        return *this;
+      }
+
+      iterator operator++(int) {
+        iterator previous = *this;
+        ++(*this);
+        return previous;
+      }
+
+      bool operator==(const iterator &other) const { return ptr_ == other.ptr_; }
+      bool operator!=(const iterator &other) const { return ptr_ != other.ptr_; }
+
+    private:
+      PALLOC_FD     fd_;
+      PALLOC_OFFSET ptr_;
+  };
+
+  // Owns an allocated blob, freeing it when destroyed unless released
+  class blob {
+    public:
+      blob() : fd_(0), ptr_(0) {}
+      blob(PALLOC_FD fd, PALLOC_OFFSET ptr) : fd_(fd), ptr_(ptr) {}
+      ~blob() { reset(); }
+
+      blob(const blob &) = delete;
+      blob &operator=(const blob &) = delete;
+
+      blob(blob &&other) noexcept : fd_(other.fd_), ptr_(other.release()) {}
+
+      blob &operator=(blob &&other) noexcept {
+        if (this != &other) {
+          reset();
+          fd_  = other.fd_;
+          ptr_ = other.release();
+        }
+        return *this;
+      }
+
+      explicit operator bool() const { return ptr_ != 0; }
+      PALLOC_OFFSET offset() const { return ptr_; }
+      PALLOC_SIZE size() const { return palloc_size(fd_, ptr_); }
+
+      int64_t read(void *buf, PALLOC_SIZE count, PALLOC_SIZE at = 0) const {
+        return palloc_read(fd_, ptr_ + at, buf, count);
+      }
+
+      int64_t write(const void *buf, PALLOC_SIZE count, PALLOC_SIZE at = 0) {
+        return palloc_write(fd_, ptr_ + at, buf, count);
+      }
+
+      // Gives up ownership, leaving the blob allocated on the medium
+      PALLOC_OFFSET release() noexcept {
+        PALLOC_OFFSET ptr = ptr_;
+        ptr_ = 0;
+        return ptr;
+      }
+
+      void reset() noexcept {
+        if (ptr_) pfree(fd_, ptr_);
+        ptr_ = 0;
+      }
+
+    private:
+      PALLOC_FD     fd_;
+      PALLOC_OFFSET ptr_;
+  };
+
+  // Owns an opened medium, closing it when destroyed
+  class medium {
+    public:
+      medium() : fd_(0) {}
+      explicit medium(PALLOC_FD fd) : fd_(fd) {}
+
+      medium(const char *filename, PALLOC_FLAGS flags = PALLOC_DEFAULT) : fd_(palloc_open(filename, flags)) {
+        if (!valid()) throw std::runtime_error("palloc: could not open medium");
+      }
+
+      ~medium() { close(); }
+
+      medium(const medium &) = delete;
+      medium &operator=(const medium &) = delete;
+
+      medium(medium &&other) noexcept : fd_(other.release()) {}
+
+      medium &operator=(medium &&other) noexcept {
+        if (this != &other) {
+          close();
+          fd_ = other.release();
+        }
+        return *this;
+      }
+
+      static medium memory() {
+        medium result(palloc_open_memory());
+        if (!result.valid()) throw std::runtime_error("palloc: could not open memory medium");
+        return result;
+      }
+
+      void init(PALLOC_FLAGS flags = PALLOC_DEFAULT) {
+        if (palloc_init(fd_, flags) != PALLOC_OK) throw std::runtime_error("palloc: could not initialize medium");
+      }
+
+      // Returns an empty blob if the medium is full
+      blob alloc(PALLOC_SIZE size) { return blob(fd_, ::palloc(fd_, size)); }
+
+      // Takes ownership of an existing blob
+      blob adopt(PALLOC_OFFSET ptr) { return blob(fd_, ptr); }
+
+      iterator begin() const { return iterator(fd_, palloc_next(fd_, 0)); }
+      iterator end() const { return iterator(fd_, 0); }
+
+      PALLOC_FD fd() const { return fd_; }
+
+      // Failed opens return 0, descriptors handed out are positive
+      bool valid() const { return fd_ > 0; }
+      explicit operator bool() const { return valid(); }
+
+      PALLOC_FD release() noexcept {
+        PALLOC_FD fd = fd_;
+        fd_ = 0;
+        return fd;
+      }
+
+      void close() noexcept {
+        if (valid()) palloc_close(fd_);
+        fd_ = 0;
+      }
+
+    private:
+      PALLOC_FD fd_;
+  };
+
+#if defined(PALLOC_HAVE_PMR)
+
+  // Memory resource allocating blobs from a medium mapped into memory
+  //
+  // The file is grown to size if smaller, and initialized without
+  // PALLOC_DYNAMIC unless it already holds a medium, as the mapping covers
+  // the file's size when opened. Every allocation stores it's blob offset
+  // right before the aligned pointer handed out, to free it by.
+  class mapped_resource : public std::pmr::memory_resource {
+    public:
+      explicit mapped_resource(const char *filename, PALLOC_SIZE size = 0) : medium_(filename, PALLOC_DEFAULT), base_(nullptr), size_(0) {
+        struct stat st;
+        if (fstat(medium_.fd(), &st)) throw std::runtime_error("palloc: could not stat medium");
+        if ((static_cast<PALLOC_SIZE>(st.st_size) < size) && ftruncate(medium_.fd(), size)) throw std::runtime_error("palloc: could not size medium");
+        if (fstat(medium_.fd(), &st) || !st.st_size) throw std::runtime_error("palloc: could not stat medium");
+        medium_.init(PALLOC_DEFAULT);
+        void *base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, medium_.fd(), 0);
+        if (base == MAP_FAILED) throw std::runtime_error("palloc: could not map medium");
+        base_ = static_cast<char *>(base);
+        size_ = st.st_size;
+      }
+
+      ~mapped_resource() {
+        if (base_) munmap(base_, size_);
+      }
+
+      mapped_resource(const mapped_resource &) = delete;
+      mapped_resource &operator=(const mapped_resource &) = delete;
+
+      const finwo::palloc::medium &medium() const { return medium_; }
+
+      // Offset within the medium of a pointer handed out by this resource
+      PALLOC_OFFSET offset(const void *p) const { return static_cast<const char *>(p) - base_; }
+      void *pointer(PALLOC_OFFSET offset) const { return base_ + offset; }
+
+    protected:
+      void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        PALLOC_SIZE   size = bytes + alignment + sizeof(PALLOC_OFFSET);
+        PALLOC_OFFSET ptr  = ::palloc(medium_.fd(), size);
+        if (!ptr) throw std::bad_alloc();
+
+        // Blobs beyond the mapping come from a medium that grew
+        if ((ptr + size) > size_) {
+          pfree(medium_.fd(), ptr);
+          throw std::bad_alloc();
+        }
+
+        std::uintptr_t data = reinterpret_cast<std::uintptr_t>(base_ + ptr + sizeof(PALLOC_OFFSET));
+        data = (data + alignment - 1) & ~(static_cast<std::uintptr_t>(alignment) - 1);
+        std::memcpy(reinterpret_cast<char *>(data) - sizeof(PALLOC_OFFSET), &ptr, sizeof(ptr));
+        return reinterpret_cast<void *>(data);
+      }
+
+      void do_deallocate(void *p, std::size_t, std::size_t) override {
+        PALLOC_OFFSET ptr;
+        std::memcpy(&ptr, static_cast<char *>(p) - sizeof(PALLOC_OFFSET), sizeof(ptr));
+        pfree(medium_.fd(), ptr);
+      }
+
+      bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+      }
+
+    private:
+      finwo::palloc::medium medium_;
+      char           *base_;
+      PALLOC_SIZE    size_;
+  };
+
+#endif
+
+} // namespace palloc
+} // namespace finwo
+
+#endif // __FINWO_PALLOC_HPP__
@@ -6,8 +6,11 @@ extern "C" {
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "finwo/assert.h"
+#include "finwo/endian.h"
 
 #include "palloc.h"
 
@@ -17,6 +20,8 @@ extern "C" {
 #include <io.h>
 #include <BaseTsd.h>
 #else
+#include <poll.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #endif
 
@@ -173,9 +178,935 @@ void test_init() {
   return;
 }
 
+void test_backend() {
+  char buf[16];
+  PALLOC_FD fd;
+
+  // In-memory medium behaves like an empty file
+  fd = palloc_open_memory();
+  ASSERT("palloc_open_memory returns a virtual descriptor", fd >= PALLOC_FD_VIRTUAL);
+  ASSERT("Initializing a memory medium returns successful", palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC) == PALLOC_OK);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 4);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  ASSERT("1st memory allocation is located at 16", alloc_0 == 16);
+  ASSERT("2nd memory allocation is located at 48", alloc_1 == 48);
+  ASSERT("Writing to a memory blob returns it's length", palloc_write(fd, alloc_1, "pizza", 6) == 6);
+  ASSERT("Reading from a memory blob returns it's length", palloc_read(fd, alloc_1, buf, 6) == 6);
+  ASSERT("Reading from a memory blob returns the written data", strcmp(buf, "pizza") == 0);
+
+  // Freeing the tail shrinks the buffer again
+  ASSERT("free(1) on memory medium returns OK", pfree(fd, alloc_1) == PALLOC_OK);
+  ASSERT("Iterating memory medium returns 1st", palloc_next(fd, 0) == alloc_0);
+  ASSERT("Iterating memory medium ends after 1st", palloc_next(fd, alloc_0) == 0);
+  ASSERT("Closing a memory medium returns OK", palloc_close(fd) == PALLOC_OK);
+
+  // Memfd mediums are regular descriptors where supported
+  fd = palloc_open_memfd("pizza");
+  ASSERT("palloc_open_memfd returns a descriptor", fd > 0);
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("1st memfd allocation is located at 16", palloc(fd, 4) == 16);
+  ASSERT("Closing a memfd medium returns OK", palloc_close(fd) == PALLOC_OK);
+}
+
+// Fails like F_SETLKW does when two read lock holders both upgrade
+int test_shared_deadlock(void *udata, PALLOC_OFFSET offset, PALLOC_SIZE length, int type) {
+  errno = EDEADLK;
+  return -1;
+}
+
+void test_shared() {
+  char *testfile = "pizza.db";
+
+  // Remove the file for this test
+  if (unlink_os(testfile)) {
+    if (errno != ENOENT) {
+      perror("unlink");
+    }
+  }
+
+  // Two descriptors keep their own cache, like separate processes would
+  PALLOC_FD fd_a = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_SHARED);
+  palloc_init(fd_a, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_SHARED);
+  ASSERT("Initializing a shared medium makes it 24 bytes", seek_os(fd_a, 0, SEEK_END) == 24);
+  PALLOC_FD fd_b = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_SHARED);
+
+  PALLOC_OFFSET alloc_a = palloc(fd_a, 32);
+  PALLOC_OFFSET alloc_b = palloc(fd_b, 32);
+  ASSERT("1st shared allocation is located at 32", alloc_a == 32);
+  ASSERT("2nd shared allocation sees the 1st one", alloc_b == 80);
+  ASSERT("Other descriptor iterates the 2nd allocation", palloc_next(fd_a, alloc_a) == alloc_b);
+
+  // Freeing through one descriptor is visible through the other
+  ASSERT("free(1) through other descriptor returns OK", pfree(fd_b, alloc_a) == PALLOC_OK);
+  ASSERT("Freed block is skipped by other descriptor", palloc_next(fd_a, 0) == alloc_b);
+  ASSERT("Freed block is re-used by other descriptor", palloc(fd_a, 16) == alloc_a);
+
+  // Writers leave an even generation behind, readers skip the lock on it
+  uint64_t generation = 0;
+  seek_os(fd_a, 8, SEEK_SET);
+  read_os(fd_a, &generation, sizeof(generation));
+  ASSERT("Finished writes leave an even generation", !(be64toh(generation) & 1));
+  ASSERT("Unlocked reader sees the other descriptor's allocation", palloc_next(fd_b, 0) == alloc_a);
+
+  // A writer mid-way makes readers fall back to the lock
+  generation = htobe64(be64toh(generation) + 1);
+  seek_os(fd_a, 8, SEEK_SET);
+  write_os(fd_a, &generation, sizeof(generation));
+  ASSERT("Reader during a write still iterates", palloc_next(fd_b, alloc_a) == alloc_b);
+  ASSERT("Writer after an odd generation returns OK", pfree(fd_b, alloc_b) == PALLOC_OK);
+  seek_os(fd_a, 8, SEEK_SET);
+  read_os(fd_a, &generation, sizeof(generation));
+  ASSERT("Writer restores an even generation", !(be64toh(generation) & 1));
+
+  // Operations fail instead of running unlocked when the lock fails
+  struct palloc_backend deadlocking = palloc_backend_os;
+  deadlocking.lock = test_shared_deadlock;
+  int raw = open_os(testfile, O_RDWR, OPENMODE);
+  PALLOC_FD fd_c = palloc_open_backend(&deadlocking, (void *)(intptr_t)raw);
+  ASSERT("Allocating without the lock returns 0", palloc(fd_c, 16) == 0);
+  ASSERT("Freeing without the lock returns ERR", pfree(fd_c, alloc_a) == PALLOC_ERR);
+  ASSERT("Failed free leaves the blob allocated", palloc_next(fd_a, 0) == alloc_a);
+  palloc_close(fd_c);
+
+  palloc_close(fd_b);
+  palloc_close(fd_a);
+}
+
+PALLOC_OFFSET bad_start = 0;
+PALLOC_OFFSET bad_end   = 0;
+
+void test_checksum_bad(PALLOC_FD fd, PALLOC_OFFSET start, PALLOC_OFFSET end, void *udata) {
+  bad_start = start;
+  bad_end   = end;
+}
+
+void test_checksum() {
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_CHECKSUM);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_2 = palloc(fd, 32);
+  ASSERT("Checksummed blob reports the requested size", palloc_size(fd, alloc_0) == 32);
+  ASSERT("Checksummed blobs include their check slot", alloc_1 == alloc_0 + 56);
+  ASSERT("Fresh checksummed medium verifies", palloc_verify(fd, NULL, NULL) == 0);
+
+  // Sealed data is verified, unsealed data is not
+  palloc_write(fd, alloc_0, "pizza", 6);
+  palloc_write(fd, alloc_1, "pizza", 6);
+  ASSERT("Sealing a blob returns OK", palloc_seal(fd, alloc_1) == PALLOC_OK);
+  ASSERT("Sealed medium verifies", palloc_verify(fd, NULL, NULL) == 0);
+  palloc_write(fd, alloc_0, "pasta", 6);
+  ASSERT("Changed unsealed blob still verifies", palloc_verify(fd, NULL, NULL) == 0);
+  palloc_write(fd, alloc_1, "pasta", 6);
+  ASSERT("Changed sealed blob is reported", palloc_verify(fd, test_checksum_bad, NULL) == 1);
+  ASSERT("Changed sealed blob is reported as it's own block", (bad_start == alloc_1 - 8) && (bad_end == alloc_2 - 8));
+
+  // A broken marker stops both verification and iteration
+  uint64_t junk = 0x1234;
+  palloc_write(fd, alloc_2 - 8, &junk, sizeof(junk));
+  ASSERT("Broken marker is reported", palloc_verify(fd, test_checksum_bad, NULL) == 2);
+  ASSERT("Broken marker taints the remainder", (bad_start == alloc_2 - 8) && (bad_end == alloc_2 + 48));
+  ASSERT("Iteration stops at a broken marker", palloc_next(fd, alloc_1) == 0);
+
+  palloc_close(fd);
+}
+
+void test_repair() {
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_2 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_3 = palloc(fd, 32);
+  pfree(fd, alloc_1);
+
+  // Simulate a crash halfway through freeing alloc_2
+  uint64_t marker = htobe64(32 | 0x8000000000000000);
+  uint64_t junk   = 0xDEAD;
+  palloc_write(fd, alloc_2 - 8 , &marker, sizeof(marker));
+  palloc_write(fd, alloc_2 + 32, &marker, sizeof(marker));
+  palloc_write(fd, alloc_1 + 8 , &junk  , sizeof(junk));
+
+  ASSERT("Repairing a medium returns OK", palloc_repair(fd) == PALLOC_OK);
+  ASSERT("Repair merges adjacent free blocks", palloc_size(fd, alloc_1) == 32 + 32 + 16);
+  ASSERT("Repaired medium iterates 1st", palloc_next(fd, 0) == alloc_0);
+  ASSERT("Repaired medium skips merged free blocks", palloc_next(fd, alloc_0) == alloc_3);
+  ASSERT("Repaired free block is re-used", palloc(fd, 80) == alloc_1);
+  ASSERT("Repaired medium allocates at the end afterwards", palloc(fd, 32) == alloc_3 + 48);
+
+  palloc_close(fd);
+}
+
+void test_trim() {
+  char buf[8];
+  PALLOC_FD fd;
+
+  // Memory buffers have no holes to punch
+  fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Trimming a memory medium is not supported", palloc_trim(fd, 0) == PALLOC_ERR);
+  palloc_close(fd);
+
+#if defined(__linux__)
+  char *z = calloc(1024*1024, sizeof(char));
+  struct stat st_before, st_after;
+  fd = palloc_open_memfd("pizza");
+  write_os(fd, z, 1024*1024);
+  palloc_init(fd, PALLOC_DEFAULT);
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  palloc_write(fd, alloc_0, "pizza", 6);
+  fstat(fd, &st_before);
+  ASSERT("Trimming a memfd medium returns OK", palloc_trim(fd, 64*1024) == PALLOC_OK);
+  fstat(fd, &st_after);
+  ASSERT("Trimming releases the free block's interior", st_after.st_blocks < st_before.st_blocks);
+  ASSERT("Trimming keeps the medium's size", st_after.st_size == st_before.st_size);
+  ASSERT("Trimming keeps allocated data", (palloc_read(fd, alloc_0, buf, 6) == 6) && (strcmp(buf, "pizza") == 0));
+  ASSERT("Trimmed block is re-used", palloc(fd, 512*1024) == alloc_0 + 48);
+  ASSERT("Trimmed medium remains consistent", palloc_verify(fd, NULL, NULL) == 0);
+  palloc_close(fd);
+  free(z);
+#endif
+}
+
+void test_defer() {
+  PALLOC_FD fd = palloc_open_memfd("pizza");
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_2 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_3 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_4 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_5 = palloc(fd, 32);
+  PALLOC_SIZE   size    = seek_os(fd, 0, SEEK_END);
+
+  ASSERT("Enabling deferred frees returns OK", palloc_defer(fd, 1) == PALLOC_OK);
+  ASSERT("Deferred free(3) returns OK", pfree(fd, alloc_3) == PALLOC_OK);
+  ASSERT("Deferred free(1) returns OK", pfree(fd, alloc_1) == PALLOC_OK);
+  ASSERT("Deferred free(2) returns OK", pfree(fd, alloc_2) == PALLOC_OK);
+  ASSERT("Deferred free(4) returns OK", pfree(fd, alloc_4) == PALLOC_OK);
+  ASSERT("Deferred frees are skipped during iteration", palloc_next(fd, alloc_0) == alloc_5);
+
+  // Deferred frees count as free space without being flushed
+  struct palloc_stats stats;
+  ASSERT("Reporting free space while deferring returns OK", palloc_available(fd, &stats) == PALLOC_OK);
+  ASSERT("Deferred frees are reported unmerged", (stats.blocks == 4) && (stats.free == 32*4) && (stats.largest == 32));
+
+  // Flushing links & merges in one go
+  ASSERT("Flushing deferred frees returns OK", palloc_flush(fd) == PALLOC_OK);
+  ASSERT("Flushed consecutive blocks have been merged", palloc_size(fd, alloc_1) == (32*4) + (16*3));
+  ASSERT("Flushed blocks are re-used", palloc(fd, 32) == alloc_1);
+  ASSERT("Medium did not grow after flushing", seek_os(fd, 0, SEEK_END) == size);
+
+  // Running out of space flushes as well
+  pfree(fd, alloc_5);
+  ASSERT("Allocation flushes deferred frees when needed", palloc(fd, 144) == alloc_1 + 48);
+  ASSERT("Flushed tail was merged & truncated before growing", seek_os(fd, 0, SEEK_END) < size);
+
+  palloc_defer(fd, 0);
+  palloc_close(fd);
+
+  // Pending frees don't cut off the free list of a re-opened medium
+  char *testfile = "pizza.db";
+  if (unlink_os(testfile)) {
+    if (errno != ENOENT) {
+      perror("unlink");
+    }
+  }
+  PALLOC_FD fd_a = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  palloc_init(fd_a, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  alloc_0 = palloc(fd_a, 32);
+  alloc_1 = palloc(fd_a, 32);
+  alloc_2 = palloc(fd_a, 64);
+  alloc_3 = palloc(fd_a, 32);
+  pfree(fd_a, alloc_2);
+  palloc_defer(fd_a, 1);
+  pfree(fd_a, alloc_0);
+
+  PALLOC_FD fd_b = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Re-opened medium skips the pending free during iteration", palloc_next(fd_b, 0) == alloc_1);
+  ASSERT("Re-opened medium reports it's free space", palloc_available(fd_b, &stats) == PALLOC_OK);
+  ASSERT("Re-opened medium finds the linked free block", (stats.blocks == 1) && (stats.largest == 64));
+  palloc_close(fd_b);
+
+  palloc_close(fd_a);
+  fd_a = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Medium re-opened after closing reports it's free space", palloc_available(fd_a, &stats) == PALLOC_OK);
+  ASSERT("Closing links the pending free", (stats.blocks == 2) && (stats.free == 96));
+  ASSERT("Re-opened medium re-uses the linked pending free", palloc(fd_a, 32) == alloc_0);
+  palloc_close(fd_a);
+}
+
+void test_append() {
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_CHECKSUM);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_2 = palloc(fd, 32);
+  pfree(fd, alloc_1);
+
+  // Too large for the hole, appended without touching it
+  PALLOC_OFFSET alloc_3 = palloc(fd, 64);
+  PALLOC_OFFSET alloc_4 = palloc(fd, 64*1024);
+  PALLOC_OFFSET alloc_5 = palloc(fd, 64);
+  ASSERT("Appended blob is placed after the last blob", alloc_3 == alloc_2 + 56);
+  ASSERT("Large appended blob is placed after the previous", alloc_4 == alloc_3 + 88);
+  ASSERT("Large appended blob reports it's size", palloc_size(fd, alloc_4) == 64*1024);
+  ASSERT("Blob after a large append is placed after it", alloc_5 == alloc_4 + (64*1024) + 24);
+
+  // Hole is still used for blobs that fit
+  ASSERT("Hole is re-used after appending", palloc(fd, 16) == alloc_1);
+  ASSERT("Iteration passes appended blobs", palloc_next(fd, alloc_3) == alloc_4);
+  ASSERT("Appended blobs verify", palloc_verify(fd, NULL, NULL) == 0);
+  ASSERT("1st blob is untouched by appending", palloc_next(fd, 0) == alloc_0);
+
+  palloc_close(fd);
+}
+
+void test_iterate() {
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_2 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_3 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_4 = palloc(fd, 32);
+  pfree(fd, alloc_1);
+  pfree(fd, alloc_3);
+
+  // Backwards
+  ASSERT("Reverse iteration starts at the last blob", palloc_prev(fd, 0) == alloc_4);
+  ASSERT("Reverse iteration skips free blocks"      , palloc_prev(fd, alloc_4) == alloc_2);
+  ASSERT("Reverse iteration reaches the first blob" , palloc_prev(fd, alloc_2) == alloc_0);
+  ASSERT("Reverse iteration ends at the first blob" , palloc_prev(fd, alloc_0) == 0);
+
+  // Bounded
+  ASSERT("Bounded iteration includes an allocated start", palloc_next_in(fd, 0, alloc_2, 0) == alloc_2);
+  ASSERT("Bounded iteration skips a free start"         , palloc_next_in(fd, 0, alloc_1, 0) == alloc_2);
+  ASSERT("Bounded iteration continues within range"     , palloc_next_in(fd, alloc_2, alloc_1, alloc_4 + 1) == alloc_4);
+  ASSERT("Bounded iteration stops at the end of range"  , palloc_next_in(fd, alloc_2, alloc_1, alloc_4) == 0);
+  ASSERT("Bounded iteration from 0 starts at the first" , palloc_next_in(fd, 0, 0, alloc_1) == alloc_0);
+  ASSERT("Bounded iteration with an empty range is done", palloc_next_in(fd, 0, 0, alloc_0) == 0);
+  ASSERT("Bounded iteration rejects a start in the header", palloc_next_in(fd, 0, 4, 0) == 0);
+  ASSERT("Bounded iteration rejects a start mid-blob"   , palloc_next_in(fd, 0, alloc_2 + 8, 0) == 0);
+  ASSERT("Bounded iteration rejects a start past the end", palloc_next_in(fd, 0, alloc_4 + 64, 0) == 0);
+
+  // Data looking like a block is not taken for one
+  uint64_t fake = htobe64(16);
+  palloc_write(fd, alloc_2     , &fake, sizeof(fake));
+  palloc_write(fd, alloc_2 + 24, &fake, sizeof(fake));
+  ASSERT("Bounded iteration rejects a start on a fake block", palloc_next_in(fd, 0, alloc_2 + 8, 0) == 0);
+
+  palloc_close(fd);
+}
+
+void test_extents() {
+  PALLOC_FD     fd = palloc_open_memory();
+  PALLOC_OFFSET alloc[64];
+  int           i;
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  // Many small holes, none large enough for a bigger blob
+  for(i = 0; i < 64; i++) alloc[i] = palloc(fd, 32);
+  for(i = 1; i < 63; i += 2) pfree(fd, alloc[i]);
+  ASSERT("Blob too large for any hole is appended", palloc(fd, 64) > alloc[63]);
+
+  // Merging 3 blocks creates a hole that does fit
+  pfree(fd, alloc[2]);
+  ASSERT("Merged hole is found for a larger blob", palloc(fd, 100) == alloc[1]);
+  ASSERT("Lowest fitting hole is used first"     , palloc(fd, 32) == alloc[5]);
+  ASSERT("Next fitting hole is used after that"  , palloc(fd, 32) == alloc[7]);
+
+  // Cache is rebuilt from the free list after repairing it
+  palloc_repair(fd);
+  ASSERT("Holes are found after a repair", palloc(fd, 32) == alloc[9]);
+  ASSERT("Blobs verify after using holes", palloc_verify(fd, NULL, NULL) == 0);
+
+  palloc_close(fd);
+}
+
+struct test_stream {
+  char        buf[4096];
+  PALLOC_SIZE length;
+  PALLOC_SIZE pos;
+};
+
+int64_t test_stream_write(const void *buf, PALLOC_SIZE count, void *udata) {
+  struct test_stream *stream = udata;
+  if ((stream->length + count) > sizeof(stream->buf)) return -1;
+  memcpy(stream->buf + stream->length, buf, count);
+  stream->length += count;
+  return count;
+}
+
+int64_t test_stream_read(void *buf, PALLOC_SIZE count, void *udata) {
+  struct test_stream *stream = udata;
+  if (count > (stream->length - stream->pos)) count = stream->length - stream->pos;
+  memcpy(buf, stream->buf + stream->pos, count);
+  stream->pos += count;
+  return count;
+}
+
+void test_bulk() {
+  PALLOC_FD          fd  = palloc_open_memory();
+  PALLOC_FD          dst = palloc_open_memory();
+  struct test_stream stream = { .length = 0, .pos = 0 };
+  PALLOC_SIZE        sizes[3] = { 5, 40, 3 };
+  const void         *data[3] = { "hello", NULL, "abc" };
+  PALLOC_OFFSET      ptrs[3];
+  char               buf[8];
+  palloc_init(fd , PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_CHECKSUM);
+  palloc_init(dst, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  ASSERT("Bulk load succeeds", palloc_bulk(fd, 3, sizes, data, ptrs) == PALLOC_OK);
+  ASSERT("Bulk blobs follow existing blobs", ptrs[0] == alloc_0 + 56);
+  ASSERT("Bulk blobs are laid out back-to-back", ptrs[1] == ptrs[0] + 40);
+  ASSERT("Bulk blobs get palloc's sizes", palloc_size(fd, ptrs[1]) == 40);
+  ASSERT("Bulk blobs are sealed and verify", palloc_verify(fd, NULL, NULL) == 0);
+  palloc_read(fd, ptrs[2], buf, 3);
+  ASSERT("Bulk blobs hold their data", memcmp(buf, "abc", 3) == 0);
+  ASSERT("Allocation continues after bulk blobs", palloc(fd, 32) == ptrs[2] + 40);
+  pfree(fd, alloc_0);
+
+  // Export skips the free block, import lays the rest out from the start
+  ASSERT("Export succeeds", palloc_export(fd, test_stream_write, &stream) == PALLOC_OK);
+  ASSERT("Export holds magic and 4 records", stream.length == 4 + (8*4) + 16 + 40 + 16 + 32);
+  ASSERT("Import succeeds", palloc_import(dst, test_stream_read, &stream) == PALLOC_OK);
+  PALLOC_OFFSET copy_0 = palloc_next(dst, 0);
+  palloc_read(dst, copy_0, buf, 5);
+  ASSERT("Imported blobs hold their data", memcmp(buf, "hello", 5) == 0);
+  ASSERT("Imported blobs keep their size", palloc_size(dst, palloc_next(dst, copy_0)) == 40);
+  ASSERT("Imported blobs keep their order", palloc_next(dst, palloc_next(dst, palloc_next(dst, palloc_next(dst, copy_0)))) == 0);
+
+  palloc_close(fd);
+  palloc_close(dst);
+}
+
+void test_hint() {
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  palloc(fd, 32);
+  PALLOC_OFFSET alloc_3 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_4 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_5 = palloc(fd, 32);
+  pfree(fd, alloc_1);
+  pfree(fd, alloc_4);
+
+  ASSERT("Hint picks the closest hole after near" , palloc_hint(fd, 32, alloc_3) == alloc_4);
+  ASSERT("Hint picks the closest hole before near", palloc_hint(fd, 32, alloc_5) == alloc_1);
+  ASSERT("Hint without fitting holes appends"     , palloc_hint(fd, 32, alloc_0) == alloc_5 + 48);
+  ASSERT("Hinted blobs verify", palloc_verify(fd, NULL, NULL) == 0);
+
+  palloc_close(fd);
+}
+
+void test_available() {
+  struct palloc_stats stats;
+  char      z[4096] = {0};
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  ASSERT("Fresh dynamic medium has no free blocks", (palloc_available(fd, &stats) == PALLOC_OK) && (stats.blocks == 0) && (stats.free == 0));
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  palloc(fd, 32);
+  PALLOC_OFFSET alloc_2 = palloc(fd, 64);
+  PALLOC_OFFSET alloc_3 = palloc(fd, 32);
+  pfree(fd, alloc_0);
+  pfree(fd, alloc_2);
+  palloc_available(fd, &stats);
+  ASSERT("Free blocks are counted"     , stats.blocks == 2);
+  ASSERT("Free bytes are summed"       , stats.free == 96);
+  ASSERT("Largest free block is known" , stats.largest == 64);
+  ASSERT("Fragmentation is reported"   , (stats.fragmentation > 0.33) && (stats.fragmentation < 0.34));
+
+  // Dynamic mediums grow to fit the reservation
+  ASSERT("Reserving on a dynamic medium succeeds", palloc_reserve(fd, 1000) == PALLOC_OK);
+  palloc_available(fd, &stats);
+  ASSERT("Reservation adds a free block", (stats.blocks == 3) && (stats.largest == 1000));
+  ASSERT("Reserving available space does not grow", palloc_reserve(fd, 500) == PALLOC_OK);
+  ASSERT("Reserved space is used by the batch", palloc(fd, 900) == alloc_3 + 48);
+  ASSERT("Reserved medium verifies", palloc_verify(fd, NULL, NULL) == 0);
+  palloc_close(fd);
+
+  // Fixed mediums can only report missing space
+  fd = palloc_open_memory();
+  palloc_write(fd, 0, z, sizeof(z));
+  palloc_init(fd, PALLOC_DEFAULT);
+  palloc_available(fd, &stats);
+  ASSERT("Fixed medium starts as a single free block", (stats.blocks == 1) && (stats.fragmentation == 0));
+  ASSERT("Reserving available space succeeds", palloc_reserve(fd, 1024) == PALLOC_OK);
+  ASSERT("Reserving beyond a fixed medium fails", palloc_reserve(fd, 8192) == PALLOC_ERR);
+  palloc_close(fd);
+}
+
+void test_handles() {
+  char      buf[8];
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_CHECKSUM | PALLOC_HANDLES);
+
+  PALLOC_OFFSET alloc_0  = palloc(fd, 32);
+  PALLOC_HANDLE handle_0 = palloc_handle(fd, 32);
+  PALLOC_HANDLE handle_1 = palloc_handle(fd, 32);
+  ASSERT("Handles are handed out in order", (handle_0 == 1) && (handle_1 == 2));
+  ASSERT("Handle table is hidden from iteration", palloc_next(fd, alloc_0) == palloc_resolve(fd, handle_0));
+  palloc_write(fd, palloc_resolve(fd, handle_1), "pizza", 6);
+  palloc_seal(fd, palloc_resolve(fd, handle_1));
+  ASSERT("Unused handles do not resolve", palloc_resolve(fd, 3) == 0);
+
+  // Moving keeps the handle, data and seal
+  pfree(fd, alloc_0);
+  ASSERT("Blob is moved into the hole", palloc_move(fd, handle_1, 1) == alloc_0);
+  ASSERT("Handle resolves to the new location", palloc_resolve(fd, handle_1) == alloc_0);
+  ASSERT("Moved blob keeps it's data", (palloc_read(fd, alloc_0, buf, 6) == 6) && (strcmp(buf, "pizza") == 0));
+  ASSERT("Moved blob remains sealed", palloc_verify(fd, NULL, NULL) == 0);
+
+  // Compacting fills holes before blobs
+  PALLOC_HANDLE handle_2 = palloc_handle(fd, 32);
+  PALLOC_OFFSET before   = palloc_resolve(fd, handle_2);
+  ASSERT("Handle blobs can be freed", pfree_handle(fd, handle_0) == PALLOC_OK);
+  ASSERT("Released handles do not resolve", palloc_resolve(fd, handle_0) == 0);
+  ASSERT("Compacting moves the last blob", palloc_compact(fd) == 1);
+  ASSERT("Compacted blob is placed earlier", palloc_resolve(fd, handle_2) < before);
+  ASSERT("Compacted medium verifies", palloc_verify(fd, NULL, NULL) == 0);
+  ASSERT("Handle slot is re-used", palloc_handle(fd, 16) == handle_0);
+  palloc_close(fd);
+
+  // The table is read back when re-opening the medium
+  char *testfile = "pizza.db";
+  if (unlink_os(testfile) && (errno != ENOENT)) perror("unlink");
+  fd = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_HANDLES);
+  handle_0 = palloc_handle(fd, 32);
+  before   = palloc_resolve(fd, handle_0);
+  palloc_close(fd);
+  fd = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Handles resolve after re-opening", palloc_resolve(fd, handle_0) == before);
+
+  // Free space behind the table survives re-opening
+  alloc_0 = palloc(fd, 64);
+  palloc(fd, 64);
+  pfree(fd, alloc_0);
+  palloc_close(fd);
+  fd = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Free list survives re-opening", palloc(fd, 64) == alloc_0);
+  palloc_close(fd);
+}
+
+void test_chain() {
+  struct palloc_stats stats;
+  struct test_stream  stream = { .length = 0, .pos = 0 };
+  char          z[4096] = {0};
+  char          in[600], out[600];
+  PALLOC_OFFSET alloc[18], copy;
+  int           i;
+  PALLOC_FD     fd  = palloc_open_memory();
+  PALLOC_FD     dst = palloc_open_memory();
+  palloc_write(fd, 0, z, sizeof(z));
+  palloc_init(fd, PALLOC_DEFAULT);
+
+  // Fragment the medium into holes of 200 bytes
+  for(i = 0; i < 18; i++) alloc[i] = palloc(fd, 200);
+  for(i = 0; i < 18; i += 2) pfree(fd, alloc[i]);
+  for(i = 0; i < 600; i++) in[i] = i % 251;
+  ASSERT("Large blob does not fit in a single hole", palloc(fd, 600) == 0);
+
+  PALLOC_OFFSET head = palloc_chain(fd, 600);
+  ASSERT("Chained blob fits in the holes", head != 0);
+  ASSERT("Chained blob reports it's size", palloc_chain_size(fd, head) == 600);
+  ASSERT("Writing across extents", palloc_chain_write(fd, head, 0, in, 600) == 600);
+  ASSERT("Reading across extents", palloc_chain_read(fd, head, 0, out, 600) == 600);
+  ASSERT("Chained data survives", memcmp(in, out, 600) == 0);
+  ASSERT("Reading a range crossing an extent", (palloc_chain_read(fd, head, 190, out, 20) == 20) && (memcmp(in + 190, out, 20) == 0));
+  ASSERT("Reading stops at the end of the blob", palloc_chain_read(fd, head, 590, out, 20) == 10);
+  ASSERT("Extents are hidden from iteration", palloc_next(fd, head) == alloc[1]);
+  ASSERT("Regular blobs are told apart from chain heads", palloc_chain_size(fd, alloc[1]) == 0);
+  ASSERT("Chained medium verifies", palloc_verify(fd, NULL, NULL) == 0);
+
+  // Export writes the chain's data, import turns it into a regular blob
+  palloc_init(dst, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Export of a chain succeeds", palloc_export(fd, test_stream_write, &stream) == PALLOC_OK);
+  ASSERT("Export holds the chain's data once", stream.length == 4 + (8*10) + 600 + (200*9));
+  ASSERT("Import of a chain succeeds", palloc_import(dst, test_stream_read, &stream) == PALLOC_OK);
+  for(copy = palloc_next(dst, 0); copy && (palloc_size(dst, copy) != 600); copy = palloc_next(dst, copy));
+  ASSERT("Imported chain holds the chain's data", copy && (palloc_read(dst, copy, out, 600) == 600) && (memcmp(in, out, 600) == 0));
+  palloc_close(dst);
+
+  // Freeing the head returns all extents
+  ASSERT("Freeing a regular blob as a chain fails", pfree_chain(fd, alloc[1]) == PALLOC_ERR);
+  palloc_available(fd, &stats);
+  PALLOC_SIZE before = stats.free;
+  ASSERT("Freeing a chain's head returns OK", pfree(fd, head) == PALLOC_OK);
+  palloc_available(fd, &stats);
+  ASSERT("Freeing a chain's head returns it's space", stats.free > before + 600);
+  palloc_close(fd);
+
+  // Dynamic mediums append what the holes can't hold
+  fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  alloc[0] = palloc(fd, 200);
+  alloc[1] = palloc(fd, 200);
+  pfree(fd, alloc[0]);
+  head = palloc_chain(fd, 600);
+  ASSERT("Dynamic chain writes", palloc_chain_write(fd, head, 0, in, 600) == 600);
+  ASSERT("Dynamic chain reads" , (palloc_chain_read(fd, head, 0, out, 600) == 600) && (memcmp(in, out, 600) == 0));
+  ASSERT("Dynamic chain verifies", palloc_verify(fd, NULL, NULL) == 0);
+  ASSERT("Freeing a dynamic chain returns OK", pfree_chain(fd, head) == PALLOC_OK);
+  ASSERT("Freeing a dynamic chain leaves no blobs behind", palloc_next(fd, alloc[1]) == 0);
+  palloc_close(fd);
+}
+
+void test_snapshot() {
+  char      buf[8];
+  char      *testfile = "pizza.db";
+  char      *snapfile = "pizza.snapshot.db";
+  PALLOC_FD fd, snap;
+
+  // Through the backend
+  fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_CHECKSUM);
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  palloc_write(fd, alloc_0, "pizza", 6);
+  ASSERT("Snapshot of a memory medium returns OK", palloc_snapshot(fd, snapfile) == PALLOC_OK);
+  palloc_close(fd);
+  snap = palloc_open(snapfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Snapshot holds the blob", palloc_next(snap, 0) == alloc_0);
+  ASSERT("Snapshot holds the data", (palloc_read(snap, alloc_0, buf, 6) == 6) && (strcmp(buf, "pizza") == 0));
+  ASSERT("Snapshot verifies", palloc_verify(snap, NULL, NULL) == 0);
+  palloc_close(snap);
+
+  // Through the kernel, with a deferred free pending
+  if (unlink_os(testfile) && (errno != ENOENT)) perror("unlink");
+  fd = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  palloc_defer(fd, 1);
+  pfree(fd, alloc_0);
+  ASSERT("Snapshot of a file medium returns OK", palloc_snapshot(fd, snapfile) == PALLOC_OK);
+  palloc_close(fd);
+  snap = palloc_open(snapfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Snapshot includes the deferred free", palloc_next(snap, 0) == alloc_1);
+  ASSERT("Snapshot re-uses the deferred free", palloc(snap, 16) == alloc_0);
+  palloc_close(snap);
+
+  // Shared mediums keep their header consistent in the copy
+  if (unlink_os(testfile) && (errno != ENOENT)) perror("unlink");
+  fd = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_SHARED);
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_SHARED);
+  alloc_0 = palloc(fd, 32);
+  alloc_1 = palloc(fd, 32);
+  pfree(fd, alloc_0);
+  ASSERT("Snapshot of a shared medium returns OK", palloc_snapshot(fd, snapfile) == PALLOC_OK);
+  ASSERT("Shared medium is usable after the snapshot", palloc(fd, 32) == alloc_0);
+  palloc_close(fd);
+  snap = palloc_open(snapfile, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_SHARED);
+  ASSERT("Shared snapshot holds the blob", palloc_next(snap, 0) == alloc_1);
+  ASSERT("Shared snapshot re-uses the free block", palloc(snap, 16) == alloc_0);
+  palloc_close(snap);
+  unlink_os(snapfile);
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+int           snapshot_go[2], snapshot_done[2];
+PALLOC_OFFSET snapshot_after = 0;
+
+// Lets the other process allocate once the copy passed snapshot_after,
+// giving it a moment to finish before copying on
+int64_t test_snapshot_read(void *udata, void *buf, PALLOC_SIZE count) {
+  struct pollfd done = { .fd = snapshot_done[0], .events = POLLIN };
+  if (snapshot_after && (palloc_backend_os.seek(udata, 0, SEEK_CUR) > (int64_t)snapshot_after)) {
+    snapshot_after = 0;
+    write_os(snapshot_go[1], "g", 1);
+    poll(&done, 1, 250);
+  }
+  return palloc_backend_os.read(udata, buf, count);
+}
+
+void test_snapshot_live() {
+  char          *testfile = "pizza.db";
+  char          *snapfile = "pizza.snapshot.db";
+  PALLOC_FLAGS  flags     = PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_SHARED;
+  PALLOC_FD     fd, snap;
+  char          go;
+  int           status = -1;
+
+  // A free block spanning several copy chunks, between live blobs
+  if (unlink_os(testfile) && (errno != ENOENT)) perror("unlink");
+  fd = palloc_open(testfile, flags);
+  palloc_init(fd, flags);
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 4*1024*1024);
+  PALLOC_OFFSET alloc_2 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_3 = palloc(fd, 32);
+  pfree(fd, alloc_1);
+  palloc_close(fd);
+
+  // Another process splits the free block while the copy is halfway
+  if (pipe(snapshot_go) || pipe(snapshot_done)) perror("pipe");
+  pid_t child = fork();
+  if (!child) {
+    close_os(snapshot_go[1]);
+    if (read_os(snapshot_go[0], &go, 1) == 1) {
+      PALLOC_FD other = palloc_open(testfile, flags);
+      status = palloc(other, 100) ? 0 : 1;
+      palloc_close(other);
+      write_os(snapshot_done[1], "d", 1);
+    }
+    _exit(status ? 1 : 0);
+  }
+  close_os(snapshot_go[0]);
+  close_os(snapshot_done[1]);
+
+  // Through the backend, as the kernel copies in one go
+  struct palloc_backend slow = palloc_backend_os;
+  slow.read = test_snapshot_read;
+  fd = palloc_open_backend(&slow, (void *)(intptr_t)open_os(testfile, O_RDWR, OPENMODE));
+  snapshot_after = alloc_1;
+  ASSERT("Snapshot while another process allocates returns OK", palloc_snapshot(fd, snapfile) == PALLOC_OK);
+  close_os(snapshot_go[1]);
+  waitpid(child, &status, 0);
+  close_os(snapshot_done[0]);
+  ASSERT("Other process allocates once the copy is done", WIFEXITED(status) && !WEXITSTATUS(status));
+  palloc_close(fd);
+
+  snap = palloc_open(snapfile, flags);
+  ASSERT("Snapshot holds the blob before the free block", palloc_next(snap, 0) == alloc_0);
+  ASSERT("Snapshot holds the free block untorn", palloc_next(snap, alloc_0) == alloc_2);
+  ASSERT("Snapshot holds the blob after the free block", palloc_next(snap, alloc_2) == alloc_3);
+  ASSERT("Snapshot verifies", palloc_verify(snap, NULL, NULL) == 0);
+  palloc_close(snap);
+  unlink_os(snapfile);
+}
+#endif
+
+void test_compress() {
+  PALLOC_FD          fd     = palloc_open_memory();
+  PALLOC_FD          dst    = palloc_open_memory();
+  struct test_stream stream = { .length = 0, .pos = 0 };
+  char               json[2048], buf[2048];
+  char               *testfile = "pizza.db";
+  PALLOC_SIZE        i, length = 0;
+  palloc_init(fd , PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_CHECKSUM | PALLOC_COMPRESS);
+  palloc_init(dst, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  for(i = 0; length < 1900; i++) {
+    length += sprintf(json + length, "{\"id\":%u,\"name\":\"pizza\",\"toppings\":[\"cheese\"]},", (unsigned int)i);
+  }
+
+  PALLOC_OFFSET alloc_0 = palloc_store(fd, json, length);
+  PALLOC_OFFSET alloc_1 = palloc_store(fd, "pizza", 6);
+  ASSERT("Compressible blob is stored", alloc_0 != 0);
+  ASSERT("Compressible blob takes less space", (alloc_1 - alloc_0) < (length / 4));
+  ASSERT("Compressed blob reports it's logical size", palloc_logical_size(fd, alloc_0) == length);
+  ASSERT("Compressed blob reports it's stored size", palloc_size(fd, alloc_0) == (alloc_1 - alloc_0 - 24));
+  ASSERT("Plain blob reports the same sizes", palloc_logical_size(fd, alloc_1) == palloc_size(fd, alloc_1));
+  ASSERT("Compressed blob loads it's data", (palloc_load(fd, alloc_0, buf, sizeof(buf)) == (int64_t)length) && (memcmp(buf, json, length) == 0));
+  ASSERT("Compressed blob loads partially", (palloc_load(fd, alloc_0, buf, 10) == 10) && (memcmp(buf, json, 10) == 0));
+  ASSERT("Small blob is stored as-is", (palloc_read(fd, alloc_1, buf, 6) == 6) && (strcmp(buf, "pizza") == 0));
+  ASSERT("Small blob loads it's data", (palloc_load(fd, alloc_1, buf, 6) == 6) && (strcmp(buf, "pizza") == 0));
+  ASSERT("Iteration includes the compressed blob", (palloc_next(fd, 0) == alloc_0) && (palloc_next(fd, alloc_0) == alloc_1));
+  ASSERT("Compressed blob can be sealed", palloc_seal(fd, alloc_0) == PALLOC_OK);
+  ASSERT("Compressed blob verifies", palloc_verify(fd, NULL, NULL) == 0);
+
+  ASSERT("Export of compressed blobs succeeds", palloc_export(fd, test_stream_write, &stream) == PALLOC_OK);
+  ASSERT("Import of compressed blobs succeeds", palloc_import(dst, test_stream_read, &stream) == PALLOC_OK);
+  alloc_0 = palloc_next(dst, 0);
+  ASSERT("Exported blob holds the logical data", (palloc_size(dst, alloc_0) == length) && (palloc_read(dst, alloc_0, buf, length) == (int64_t)length) && (memcmp(buf, json, length) == 0));
+
+  pfree(fd, alloc_1);
+  palloc_close(dst);
+  palloc_close(fd);
+
+  // Re-opening skips over compressed blobs to find free space
+  if (unlink_os(testfile) && (errno != ENOENT)) perror("unlink");
+  fd = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_COMPRESS);
+  alloc_0 = palloc_store(fd, json, length);
+  alloc_1 = palloc(fd, 64);
+  palloc(fd, 64);
+  pfree(fd, alloc_1);
+  palloc_close(fd);
+  fd = palloc_open(testfile, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Re-opened medium re-uses free space after compressed blob", palloc(fd, 64) == alloc_1);
+  palloc_close(fd);
+}
+
+#ifdef PALLOC_TRACE
+struct test_trace {
+  PALLOC_SIZE started[PALLOC_TRACE_OPS];
+  PALLOC_SIZE ended[PALLOC_TRACE_OPS];
+  PALLOC_SIZE visited;
+  PALLOC_OFFSET last;
+};
+
+void test_trace_hook(const struct palloc_trace *event, void *udata) {
+  struct test_trace *trace = udata;
+  if (!event->done) {
+    trace->started[event->op]++;
+    return;
+  }
+  trace->ended[event->op]++;
+  trace->visited += event->visited;
+  if (event->op == PALLOC_TRACE_PALLOC) trace->last = event->ptr;
+}
+
+void test_trace() {
+  struct test_trace trace;
+  uint64_t          buckets[PALLOC_TRACE_BUCKETS];
+  PALLOC_SIZE       i, total = 0;
+  memset(&trace, 0, sizeof(trace));
+  palloc_trace_reset();
+  palloc_trace_hook(test_trace_hook, &trace);
+
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  PALLOC_OFFSET alloc_0 = palloc(fd, 32);
+  PALLOC_OFFSET alloc_1 = palloc(fd, 32);
+  palloc(fd, 32);
+  pfree(fd, alloc_0);
+  pfree(fd, alloc_1);
+  palloc_next(fd, 0);
+  PALLOC_OFFSET alloc_3 = palloc_store(fd, "pizza", 6);
+  palloc_trace_hook(NULL, NULL);
+
+  ASSERT("Every traced operation starts and ends", memcmp(trace.started, trace.ended, sizeof(trace.started)) == 0);
+  ASSERT("Allocations are traced, stored ones too", trace.ended[PALLOC_TRACE_PALLOC] == 4);
+  ASSERT("Allocation end carries the pointer", trace.last == alloc_3);
+  ASSERT("Frees are traced", trace.ended[PALLOC_TRACE_PFREE] == 2);
+  ASSERT("Merges are traced", trace.ended[PALLOC_TRACE_MERGE] > 0);
+  ASSERT("Iteration is traced", trace.ended[PALLOC_TRACE_NEXT] == 1);
+  ASSERT("Medium initialization is traced", trace.ended[PALLOC_TRACE_INIT] == 1);
+  ASSERT("Visited nodes are counted", trace.visited > 0);
+
+  palloc_trace_histogram(PALLOC_TRACE_PALLOC, buckets);
+  for(i = 0; i < PALLOC_TRACE_BUCKETS; i++) total += buckets[i];
+  ASSERT("Histogram counts every allocation", total == 4);
+  palloc_trace_reset();
+  palloc_trace_histogram(PALLOC_TRACE_PALLOC, buckets);
+  ASSERT("Histogram is cleared on reset", buckets[0] == 0);
+  palloc_close(fd);
+}
+#endif
+
+// Reads a LEB128 varint from a trace, returns whether that succeeded
+int test_varint(const unsigned char *buf, int64_t length, int64_t *pos, uint64_t *value) {
+  int shift = 0;
+  *value = 0;
+  while(*pos < length) {
+    *value |= ((uint64_t)(buf[*pos] & 0x7F)) << shift;
+    if (!(buf[(*pos)++] & 0x80)) return 1;
+    shift += 7;
+  }
+  return 0;
+}
+
+void test_record() {
+  char          *tracefile = "pizza.trace";
+  unsigned char buf[1024];
+  uint32_t      flags;
+  int           descriptor;
+  int64_t       length, pos;
+  uint64_t      value, ptr, live[32];
+  int           allocs = 0, frees = 0, unknown = 0, nlive = 0, i;
+  PALLOC_SIZE   sizes[2] = { 24, 40 };
+  PALLOC_OFFSET ptrs[2];
+
+  PALLOC_FD fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC);
+  ASSERT("Recording starts", palloc_record(fd, tracefile) == PALLOC_OK);
+  PALLOC_OFFSET alloc_0 = palloc(fd, 200);
+  pfree(fd, alloc_0);
+  ASSERT("Recording stops", palloc_record(fd, NULL) == PALLOC_OK);
+  palloc(fd, 32);
+  palloc_close(fd);
+
+  descriptor = open_os(tracefile, O_RDONLY);
+  length     = read_os(descriptor, buf, sizeof(buf));
+  close_os(descriptor);
+  unlink_os(tracefile);
+  memcpy(&flags, buf + 4, sizeof(flags));
+
+  ASSERT("Trace starts with the magic", (length >= 16) && (memcmp(buf, "PBR\0", 4) == 0));
+  ASSERT("Trace holds the medium's flags", be32toh(flags) == (PALLOC_DEFAULT | PALLOC_DYNAMIC));
+  ASSERT("Trace holds one allocation and one free", (length > 16) && (buf[16] == 'a') && (memchr(buf + 17, 'f', length - 17) != NULL));
+  ASSERT("Allocation record is compact", length <= (16 + 2*(1 + 10 + 2 + 2)));
+
+  // Every path allocating or freeing is recorded, left for make check to
+  // replay
+  fd = palloc_open_memory();
+  palloc_init(fd, PALLOC_DEFAULT | PALLOC_DYNAMIC | PALLOC_HANDLES);
+  palloc_record(fd, tracefile);
+  PALLOC_OFFSET stored = palloc_store(fd, "pizza", 6);
+  palloc_bulk(fd, 2, sizes, NULL, ptrs);
+  PALLOC_HANDLE handle_0 = palloc_handle(fd, 32);
+  palloc_handle(fd, 32);
+  pfree_handle(fd, handle_0);
+  ASSERT("Compaction moves a recorded blob", palloc_compact(fd) == 1);
+  PALLOC_OFFSET head = palloc_chain(fd, 600);
+  pfree(fd, head);
+  pfree(fd, stored);
+  palloc_record(fd, NULL);
+  palloc_close(fd);
+
+  descriptor = open_os(tracefile, O_RDONLY);
+  length     = read_os(descriptor, buf, sizeof(buf));
+  close_os(descriptor);
+  for(pos = 16; pos < length;) {
+    int op = buf[pos++];
+    if (!test_varint(buf, length, &pos, &value)) break;
+    if ((op == 'a') && test_varint(buf, length, &pos, &value) && test_varint(buf, length, &pos, &ptr) && (nlive < 32)) {
+      live[nlive++] = ptr;
+      allocs++;
+    } else if ((op == 'f') && test_varint(buf, length, &pos, &ptr)) {
+      for(i = 0; (i < nlive) && (live[i] != ptr); i++);
+      if (i == nlive) unknown++;
+      else live[i] = live[--nlive];
+      frees++;
+    } else {
+      break;
+    }
+  }
+  ASSERT("Trace of every path is read to it's end", pos == length);
+  ASSERT("Store, bulk, handles, moves and chains are recorded", (allocs >= 9) && (frees >= 5));
+  ASSERT("Every recorded free has a recorded allocation", unknown == 0);
+  ASSERT("Recorded blobs left match the live ones", nlive == 4);
+}
+
 int main() {
   RUN(test_open);
   RUN(test_init);
+  RUN(test_backend);
+  RUN(test_shared);
+  RUN(test_checksum);
+  RUN(test_repair);
+  RUN(test_trim);
+  RUN(test_defer);
+  RUN(test_append);
+  RUN(test_iterate);
+  RUN(test_extents);
+  RUN(test_bulk);
+  RUN(test_hint);
+  RUN(test_available);
+  RUN(test_handles);
+  RUN(test_chain);
+  RUN(test_snapshot);
+#if !defined(_WIN32) && !defined(_WIN64)
+  RUN(test_snapshot_live);
+#endif
+  RUN(test_compress);
+  RUN(test_record);
+#ifdef PALLOC_TRACE
+  RUN(test_trace);
+#endif
   return TEST_REPORT();
 }
 
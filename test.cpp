@@ -0,0 +1,117 @@
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "finwo/assert.h"
+
+#include "palloc.hpp"
+
+using namespace finwo::palloc;
+
+void test_medium() {
+  medium pmedium = medium::memory();
+  ASSERT("medium::memory returns a valid medium", pmedium.valid());
+  ASSERT("virtual descriptors are valid", pmedium.fd() >= PALLOC_FD_VIRTUAL);
+  pmedium.init(PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  medium moved(std::move(pmedium));
+  ASSERT("moved-from medium is no longer valid", !pmedium.valid());
+  ASSERT("moved-to medium is valid", moved.valid());
+
+  medium empty;
+  ASSERT("default medium is not valid", !empty.valid());
+}
+
+void test_blob() {
+  medium pmedium = medium::memory();
+  pmedium.init(PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  PALLOC_OFFSET freed;
+  {
+    blob data = pmedium.alloc(32);
+    ASSERT("alloc returns a blob", static_cast<bool>(data));
+    ASSERT("blob holds at least the requested size", data.size() >= 32);
+    ASSERT("blob writes", data.write("pizza", 6) == 6);
+    char buf[6];
+    ASSERT("blob reads", data.read(buf, 6) == 6);
+    ASSERT("blob reads what was written", !std::memcmp(buf, "pizza", 6));
+    freed = data.offset();
+  }
+  ASSERT("blob is freed when leaving scope", pmedium.begin() == pmedium.end());
+
+  blob kept = pmedium.alloc(16);
+  blob moved(std::move(kept));
+  ASSERT("moved-from blob is empty", !kept);
+  ASSERT("freed space is reused", moved.offset() == freed);
+
+  PALLOC_OFFSET released = moved.release();
+  ASSERT("released blob is empty", !moved);
+  ASSERT("released blob stays allocated", *pmedium.begin() == released);
+
+  blob adopted = pmedium.adopt(released);
+  adopted.reset();
+  ASSERT("reset frees the blob", pmedium.begin() == pmedium.end());
+}
+
+void test_iterate() {
+  medium pmedium = medium::memory();
+  pmedium.init(PALLOC_DEFAULT | PALLOC_DYNAMIC);
+
+  std::vector<blob> blobs;
+  for (int i = 0; i < 4; i++) blobs.push_back(pmedium.alloc(16 * (i + 1)));
+
+  int count   = 0;
+  int ordered = 1;
+  for (PALLOC_OFFSET ptr : pmedium) {
+    ordered &= (count < 4) && (ptr == blobs[count].offset());
+    count++;
+  }
+  ASSERT("iteration follows allocation order", ordered);
+  ASSERT("iteration visits every blob", count == 4);
+}
+
+#if defined(PALLOC_HAVE_PMR)
+void test_resource() {
+  const char *testfile = "pizza.pmr.db";
+  std::remove(testfile);
+
+  {
+    mapped_resource resource(testfile, 64 * 1024);
+    ASSERT("resource initializes it's medium", resource.medium().begin() == resource.medium().end());
+
+    // Growing without reserving moves the vector across allocations
+    std::pmr::vector<int> numbers(&resource);
+    for (int i = 0; i < 1000; i++) numbers.push_back(i * 3);
+
+    int intact = 1;
+    for (int i = 0; i < 1000; i++) intact &= numbers[i] == (i * 3);
+    ASSERT("vector keeps it's values while growing", intact);
+
+    PALLOC_OFFSET ptr = resource.offset(numbers.data());
+    ASSERT("vector data lives on the medium", ptr > 0);
+    ASSERT("vector data is addressable by offset", resource.pointer(ptr) == numbers.data());
+
+    int count = 0;
+    for (PALLOC_OFFSET blob : resource.medium()) { (void)blob; count++; }
+    ASSERT("only the current vector storage remains allocated", count == 1);
+  }
+
+  {
+    mapped_resource reopened(testfile);
+    ASSERT("reopened resource frees what the vector released", reopened.medium().begin() == reopened.medium().end());
+  }
+
+  std::remove(testfile);
+}
+#endif
+
+int main() {
+  RUN(test_medium);
+  RUN(test_blob);
+  RUN(test_iterate);
+#if defined(PALLOC_HAVE_PMR)
+  RUN(test_resource);
+#endif
+  return TEST_REPORT();
+}